@@ -1,49 +1,186 @@
 import esphome.config_validation as cv
 import esphome.codegen as cg
+from esphome import pins
 from esphome.components import uart, sensor, time
 from esphome.const import (
     CONF_ID,
+    CONF_PORT,
+    CONF_RESET_PIN,
     CONF_UART_ID,
 )
+from esphome.core import CORE
+import esphome.final_validate as fv
 
+DOMAIN = "otgw"
 CONF_OTGW_ID = "otgw_id"
 
 DEPENDENCIES = ["uart"]
-AUTO_LOAD = ["sensor", "text_sensor", "binary_sensor", "climate"]
+# One instance per gateway, e.g. for boilers in a cascade each with their own gateway and UART
+MULTI_CONF = True
+AUTO_LOAD = ["sensor", "text_sensor", "binary_sensor", "climate", "socket"]
 
 otgw_ns = cg.esphome_ns.namespace('otgw')
 OpenthermGateway = otgw_ns.class_('OpenthermGateway', uart.UARTDevice, cg.Component)
 
 CONF_REUSE_MASTER_SLOTS = "reuse_master_slots"
+CONF_USE_ALTERNATIVES = "use_alternatives"
+CONF_SUMMARY_INTERVAL = "summary_interval"
 CONF_IGNORE_HEATER_OVERRIDES = "ignore_heater_overrides"
 CONF_OUTSIDE_TEMPERATURE = "outside_temperature"
+CONF_OUTSIDE_TEMPERATURE_DEADBAND = "outside_temperature_deadband"
+CONF_OUTSIDE_TEMPERATURE_INTERVAL = "outside_temperature_interval"
 CONF_TIME_SOURCE = "time_source"
+CONF_TIME_SYNC_TOLERANCE = "time_sync_tolerance"
+CONF_STATISTICS = "statistics"
+CONF_PROFILER = "profiler"
+CONF_MAX_BYTES_PER_LOOP = "max_bytes_per_loop"
+CONF_MAX_LINES_PER_LOOP = "max_lines_per_loop"
+CONF_MAX_TIME_PER_LOOP = "max_time_per_loop"
+CONF_FRAME_LOG_LEVEL = "frame_log_level"
+CONF_TRACE_SIZE = "trace_size"
+CONF_READER_TASK = "reader_task"
+CONF_PASSTHROUGH = "passthrough"
+CONF_BUFFER_SIZE = "buffer_size"
 
-CONFIG_SCHEMA = cv.Schema({
+FRAME_LOG_LEVELS = {
+    "NONE": 0,
+    "DEBUG": 1,
+    "VERBOSE": 2,
+}
+
+def default_reset_pin(config):
+    # The ESP8266 board sold with the gateway has the reset of the PIC on D5
+    if CONF_RESET_PIN not in config and CORE.is_esp8266:
+        config[CONF_RESET_PIN] = pins.gpio_output_pin_schema("GPIO14")
+    return config
+
+def final_validate(config):
+    # MULTI_CONF validates every instance on its own, the checks across gateways are done here
+    instances = fv.full_config.get()[DOMAIN]
+    if len(instances) > 1 and CORE.is_esp8266 and any(CONF_RESET_PIN not in conf for conf in instances):
+        raise cv.Invalid(f"Every gateway needs its own {CONF_RESET_PIN}, the default only fits a single gateway")
+
+    ports = [conf[CONF_PASSTHROUGH][CONF_PORT] for conf in instances if CONF_PASSTHROUGH in conf]
+    if len(ports) != len(set(ports)):
+        raise cv.Invalid(f"Every gateway needs its own {CONF_PASSTHROUGH} {CONF_PORT}")
+    return config
+
+def max_frame_log_level():
+    # All gateways must emit the same define
+    return max(FRAME_LOG_LEVELS[conf[CONF_FRAME_LOG_LEVEL]] for conf in CORE.config[DOMAIN])
+
+def validate_reader_task(value):
+    value = cv.boolean(value)
+    if value and not CORE.is_esp32:
+        raise cv.Invalid("The reader task is only available on the ESP32")
+    return value
+
+def validate_summary_interval(config):
+    # The reader task only passes on short lines, summaries are about 200 characters
+    if CONF_SUMMARY_INTERVAL in config and config[CONF_READER_TASK]:
+        raise cv.Invalid(f"{CONF_SUMMARY_INTERVAL} can not be combined with {CONF_READER_TASK}")
+    return config
+
+CONFIG_SCHEMA = cv.All(cv.Schema({
     cv.GenerateID(): cv.declare_id(OpenthermGateway),
 
+    cv.Optional(CONF_RESET_PIN): pins.gpio_output_pin_schema,
+
     cv.Optional(CONF_REUSE_MASTER_SLOTS): cv.boolean,
     cv.Optional(CONF_IGNORE_HEATER_OVERRIDES): cv.boolean,
+    cv.Optional(CONF_USE_ALTERNATIVES): cv.boolean,
+    cv.Optional(CONF_SUMMARY_INTERVAL): cv.positive_time_period_milliseconds,
     cv.Optional(CONF_OUTSIDE_TEMPERATURE): cv.use_id(sensor.Sensor),
+    cv.Optional(CONF_OUTSIDE_TEMPERATURE_DEADBAND): cv.positive_float,
+    cv.Optional(CONF_OUTSIDE_TEMPERATURE_INTERVAL): cv.positive_time_period_milliseconds,
     cv.Optional(CONF_TIME_SOURCE): cv.use_id(time.RealTimeClock),
-}).extend(uart.UART_DEVICE_SCHEMA)
+    cv.Optional(CONF_TIME_SYNC_TOLERANCE): cv.positive_time_period_seconds,
+    cv.Optional(CONF_STATISTICS): cv.boolean,
+    cv.Optional(CONF_PROFILER, default=False): cv.boolean,
+    cv.Optional(CONF_MAX_BYTES_PER_LOOP): cv.uint16_t,
+    cv.Optional(CONF_MAX_LINES_PER_LOOP): cv.uint16_t,
+    cv.Optional(CONF_MAX_TIME_PER_LOOP): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_FRAME_LOG_LEVEL, default="NONE"): cv.enum(FRAME_LOG_LEVELS, upper=True),
+    cv.Optional(CONF_TRACE_SIZE): cv.uint16_t,
+    cv.Optional(CONF_READER_TASK, default=False): validate_reader_task,
+    cv.Optional(CONF_PASSTHROUGH): cv.Schema({
+        cv.Optional(CONF_PORT, default=25238): cv.port,
+        cv.Optional(CONF_BUFFER_SIZE, default=1024): cv.int_range(min=256, max=16384),
+    }),
+}).extend(uart.UART_DEVICE_SCHEMA), validate_summary_interval)
+
+FINAL_VALIDATE_SCHEMA = final_validate
 
 async def to_code(config):
     uart_component = await cg.get_variable(config[CONF_UART_ID])
     var = cg.new_Pvariable(config[CONF_ID], uart_component)
 
+    config = default_reset_pin(config)
+    if CONF_RESET_PIN in config:
+        pin = await cg.gpio_pin_expression(config[CONF_RESET_PIN])
+        cg.add(var.set_reset_pin(pin))
+
     if CONF_REUSE_MASTER_SLOTS in config:
         cg.add(var.reuse_master_slots(config[CONF_REUSE_MASTER_SLOTS]))
 
     if CONF_IGNORE_HEATER_OVERRIDES in config:
         cg.add(var.ignore_heater_overrides(config[CONF_IGNORE_HEATER_OVERRIDES]))
 
+    if CONF_USE_ALTERNATIVES in config:
+        cg.add(var.use_alternatives(config[CONF_USE_ALTERNATIVES]))
+
+    if CONF_SUMMARY_INTERVAL in config:
+        cg.add(var.set_summary_interval(config[CONF_SUMMARY_INTERVAL]))
+
+    if CONF_STATISTICS in config:
+        cg.add(var.enable_statistics(config[CONF_STATISTICS]))
+
+    if config[CONF_PROFILER]:
+        cg.add_define("USE_OTGW_PROFILER")
+        cg.add(var.enable_profiler(True))
+
+    if CONF_MAX_BYTES_PER_LOOP in config:
+        cg.add(var.set_max_bytes_per_loop(config[CONF_MAX_BYTES_PER_LOOP]))
+
+    if CONF_MAX_LINES_PER_LOOP in config:
+        cg.add(var.set_max_lines_per_loop(config[CONF_MAX_LINES_PER_LOOP]))
+
+    if CONF_MAX_TIME_PER_LOOP in config:
+        cg.add(var.set_max_time_per_loop(config[CONF_MAX_TIME_PER_LOOP]))
+
+    # The defines compile the code in for all gateways, the options are set per gateway
+    frame_log_level = FRAME_LOG_LEVELS[config[CONF_FRAME_LOG_LEVEL]]
+    cg.add_define("OTGW_FRAME_LOG_LEVEL", max_frame_log_level())
+    if frame_log_level != 0:
+        cg.add(var.set_frame_log_level(frame_log_level))
+
+    if CONF_TRACE_SIZE in config:
+        cg.add(var.set_trace_size(config[CONF_TRACE_SIZE]))
+
+    if config[CONF_READER_TASK]:
+        cg.add_define("USE_OTGW_READER_TASK")
+        cg.add(var.set_reader_task(True))
+
+    if CONF_PASSTHROUGH in config:
+        cg.add_define("USE_OTGW_PASSTHROUGH")
+        cg.add(var.set_passthrough_port(config[CONF_PASSTHROUGH][CONF_PORT]))
+        cg.add(var.set_passthrough_buffer_size(config[CONF_PASSTHROUGH][CONF_BUFFER_SIZE]))
+
     if CONF_OUTSIDE_TEMPERATURE in config:
         sens = await cg.get_variable(config[CONF_OUTSIDE_TEMPERATURE])
         cg.add(var.set_outside_temperature_override(sens));
 
+    if CONF_OUTSIDE_TEMPERATURE_DEADBAND in config:
+        cg.add(var.set_outside_temperature_deadband(config[CONF_OUTSIDE_TEMPERATURE_DEADBAND]))
+
+    if CONF_OUTSIDE_TEMPERATURE_INTERVAL in config:
+        cg.add(var.set_outside_temperature_interval(config[CONF_OUTSIDE_TEMPERATURE_INTERVAL]))
+
     if CONF_TIME_SOURCE in config:
         sens = await cg.get_variable(config[CONF_TIME_SOURCE])
         cg.add(var.set_time_source(sens));
 
+    if CONF_TIME_SYNC_TOLERANCE in config:
+        cg.add(var.set_time_sync_tolerance(config[CONF_TIME_SYNC_TOLERANCE]))
+
     await cg.register_component(var, config)
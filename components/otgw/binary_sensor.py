@@ -8,6 +8,19 @@ from . import OpenthermGateway, CONF_OTGW_ID
 
 AUTO_LOAD = ["otgw"]
 
+CONF_CUSTOM = "custom"
+CONF_DATA_ID = "data_id"
+CONF_BIT = "bit"
+CONF_INTERVAL = "interval"
+
+# A single bit of a data type that has no sensor of its own, e.g. an OEM specific one
+CUSTOM_BINARY_SENSOR_SCHEMA = binary_sensor.binary_sensor_schema().extend({
+    cv.Required(CONF_DATA_ID): cv.uint8_t,
+    cv.Required(CONF_BIT): cv.int_range(min=0, max=15),
+    # How often the data type is requested when the thermostat does not
+    cv.Optional(CONF_INTERVAL, default="10min"): cv.positive_time_period_minutes,
+})
+
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(CONF_OTGW_ID): cv.use_id(OpenthermGateway),
 
@@ -52,6 +65,8 @@ CONFIG_SCHEMA = cv.Schema({
     cv.Optional("water_overtemperature"): binary_sensor.binary_sensor_schema(
         device_class="problem",
     ),
+
+    cv.Optional(CONF_CUSTOM): cv.ensure_list(CUSTOM_BINARY_SENSOR_SCHEMA),
 })
 
 async def to_code(config):
@@ -65,3 +80,7 @@ async def to_code(config):
         if id and id.type == binary_sensor.BinarySensor:
             sens = await binary_sensor.new_binary_sensor(conf)
             cg.add(getattr(hub, f"set_sensor({hub}->{key}, {sens})"))
+
+    for conf in config.get(CONF_CUSTOM, []):
+        sens = await binary_sensor.new_binary_sensor(conf)
+        cg.add(hub.add_custom_binary_sensor(sens, conf[CONF_DATA_ID], conf[CONF_BIT], conf[CONF_INTERVAL].total_minutes))
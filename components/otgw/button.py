@@ -3,6 +3,7 @@ import esphome.config_validation as cv
 from esphome.components import button
 from esphome.const import (
     CONF_ID,
+    ENTITY_CATEGORY_DIAGNOSTIC,
 )
 from . import OpenthermGateway, CONF_OTGW_ID, otgw_ns
 
@@ -10,6 +11,8 @@ AUTO_LOAD = ["otgw"]
 
 CONF_RESET_SERVICE_REQUEST = "reset_service_request"
 CONF_HOT_WATER_PUSH = "hot_water_push"
+CONF_DUMP_STATISTICS = "dump_statistics"
+CONF_DUMP_TRACE = "dump_trace"
 
 OpenthermGatewayButton = otgw_ns.class_("OpenthermGatewayButton", button.Button)
 
@@ -18,6 +21,14 @@ CONFIG_SCHEMA = cv.Schema({
 
     cv.Optional(CONF_RESET_SERVICE_REQUEST): button.button_schema(OpenthermGatewayButton),
     cv.Optional(CONF_HOT_WATER_PUSH): button.button_schema(OpenthermGatewayButton),
+    cv.Optional(CONF_DUMP_STATISTICS): button.button_schema(
+        OpenthermGatewayButton,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional(CONF_DUMP_TRACE): button.button_schema(
+        OpenthermGatewayButton,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
 })
 
 async def to_code(config):
@@ -29,3 +40,9 @@ async def to_code(config):
     if CONF_HOT_WATER_PUSH in config:
         var = await button.new_button(config[CONF_HOT_WATER_PUSH])
         cg.add(hub.set_hot_water_push_button(var))
+    if CONF_DUMP_STATISTICS in config:
+        var = await button.new_button(config[CONF_DUMP_STATISTICS])
+        cg.add(hub.set_dump_statistics_button(var))
+    if CONF_DUMP_TRACE in config:
+        var = await button.new_button(config[CONF_DUMP_TRACE])
+        cg.add(hub.set_dump_trace_button(var))
@@ -18,27 +18,32 @@ OpenthermGatewayClimate::OpenthermGatewayClimate() {
 }
 
 void OpenthermGatewayClimate::control(const climate::ClimateCall &call) {
-  bool publish = false;
-
   // TODO: It might be better to only publish once OTGW confirms the change. It depends on how this would affect interaction in Home Assistant.
 
-  if (call.get_mode().has_value()) {
-    auto new_mode = *call.get_mode();
-    if (new_mode != climate::CLIMATE_MODE_OFF) {
-      this->mode = new_mode;
-      _mode_callback();
-    }
+  // Off is not supported, the thermostat stays in control of that. What changed is decided against
+  // the last commanded values, the state only mirrors the bus.
+  bool mode_changed = call.get_mode().has_value() && *call.get_mode() != climate::CLIMATE_MODE_OFF &&
+                      _commanded_mode.command(*call.get_mode());
+  bool target_changed =
+    call.get_target_temperature().has_value() && _commanded_target_temperature.command(*call.get_target_temperature());
 
-    publish = true;
+  if (mode_changed) {
+    this->mode = *call.get_mode();
   }
-
-  if (call.get_target_temperature().has_value()) {
+  if (target_changed) {
     this->target_temperature = *call.get_target_temperature();
+  }
+
+  // The mode callback sends the target temperature as well, so one command covers both changes
+  if (mode_changed) {
+    _mode_callback();
+  } else if (target_changed) {
     _target_callback();
-    publish = true;
   }
 
-  if (publish) {
+  // Every call with a mode or target is answered with the state, also a rejected or unchanged one, so
+  // the frontend falls back to the current values instead of waiting for a change
+  if (call.get_mode().has_value() || call.get_target_temperature().has_value()) {
     this->publish_state();
   }
 }
@@ -48,6 +53,7 @@ void OpenthermGatewayClimate::set_cooling_supported(bool supported) {
 }
 
 void OpenthermGatewayClimate::set_target_temperature(float temperature) {
+  _commanded_target_temperature.report(temperature);
   this->target_temperature = temperature;
   this->publish_state();
 }
@@ -71,6 +77,7 @@ void OpenthermGatewayClimate::set_action(climate::ClimateAction action) {
 }
 
 void OpenthermGatewayClimate::set_mode(climate::ClimateMode mode) {
+  _commanded_mode.report(mode);
   this->mode = mode;
   this->publish_state();
 }
@@ -83,6 +90,11 @@ void OpenthermGatewayClimate::set_callbacks(
   _mode_callback = mode_callback;
 }
 
+void OpenthermGatewayClimate::forget_commanded() {
+  _commanded_mode.forget();
+  _commanded_target_temperature.forget();
+}
+
 climate::ClimateTraits OpenthermGatewayClimate::traits() { return _traits; }
 
 }  // namespace otgw
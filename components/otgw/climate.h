@@ -2,6 +2,8 @@
 
 #include "esphome/components/climate/climate.h"
 
+#include "commanded_value.h"
+
 namespace esphome {
 namespace otgw {
 
@@ -10,6 +12,8 @@ class OpenthermGatewayClimate : public Component, public climate::Climate {
   std::function<void()> _target_callback;
   std::function<void()> _mode_callback;
   climate::ClimateTraits _traits;
+  CommandedValue<climate::ClimateMode> _commanded_mode;
+  CommandedValue<float> _commanded_target_temperature;
 
  public:
   OpenthermGatewayClimate();
@@ -26,6 +30,8 @@ class OpenthermGatewayClimate : public Component, public climate::Climate {
   void set_action(climate::ClimateAction action);
 
   void set_callbacks(decltype(_target_callback) &&target_callback, decltype(_mode_callback) &&mode_callback);
+  // The gateway was reset, the next call sends its mode and target again
+  void forget_commanded();
 
   climate::ClimateTraits traits() override;
 };
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cmath>
+#include <optional>
+#include <type_traits>
+
+namespace esphome {
+namespace otgw {
+
+// Last value sent to the gateway for a mode or target, so a call only sends what changed. The state
+// of the entities mirrors the bus instead and can not tell whether the gateway has our value: it is
+// the same when the thermostat happens to use it, and still shows it for a while after the gateway
+// was reset or the override expired.
+template<typename T>
+class CommandedValue {
+ public:
+  // A value requested by a call, returns whether it has to be sent
+  bool command(T value) {
+    if (_value && *_value == value) {
+      return false;
+    }
+    _value = value;
+    return true;
+  }
+
+  // A value read from the bus. When it differs from ours the gateway no longer uses it, e.g. the
+  // thermostat changed its program, so the next call sends it again. Right after a command the bus
+  // may still show the old value, which only costs a repeated command.
+  void report(T value) {
+    if (_value && !same(*_value, value)) {
+      _value.reset();
+    }
+  }
+
+  // The gateway forgot the value, e.g. after a reset
+  void forget() { _value.reset(); }
+
+  std::optional<T> const &value() const { return _value; }
+
+ protected:
+  // Temperatures come back from the bus as f8.8, which can not hold every step of 0.01
+  static bool same(T a, T b) {
+    if constexpr (std::is_floating_point<T>::value) {
+      return std::fabs(a - b) < 0.01f;
+    } else {
+      return a == b;
+    }
+  }
+
+  std::optional<T> _value;
+};
+
+}  // namespace otgw
+}  // namespace esphome
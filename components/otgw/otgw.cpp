@@ -1,195 +1,420 @@
 #include "otgw.h"
 
-#include "esphome/components/esp8266/gpio.h"
+#ifdef USE_OTGW_READER_TASK
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#endif
 
 namespace esphome {
 namespace otgw {
 
 using namespace data_types;
 
-float OpenthermGateway::parse_float(uint16_t data) { return ((data & 0x8000) ? -(0x10000L - data) : data) / 256.0f; }
-
-int16_t OpenthermGateway::parse_int16(uint16_t data) { return *reinterpret_cast<int16_t *>(&data); }
-
-int8_t OpenthermGateway::parse_int8(uint8_t data) { return *reinterpret_cast<int8_t *>(&data); }
-
-bool OpenthermGateway::is_error(std::string const &command_code) {
-  if (command_code == "NG")
-    ESP_LOGE("otgw", "The command code is unknown.");
-  else if (command_code == "SE")
-    ESP_LOGE("otgw", "The command contained an unexpected character or was incomplete.");
-  else if (command_code == "BV")
-    ESP_LOGE("otgw", "The command contained a data value that is not allowed.");
-  else if (command_code == "OR")
-    ESP_LOGE("otgw", "A number was specified outside of the allowed range.");
-  else if (command_code == "NS")
-    ESP_LOGE("otgw", "The alternative Data-ID could not be added because the table is full.");
-  else if (command_code == "NF")
-    ESP_LOGI("otgw", "The specified alternative Data-ID could not be removed because it does not exist in the table.");
-  else if (command_code == "OE")
-    ESP_LOGE("otgw", "The processor was busy and failed to process all received characters.");
-  else
-    return false;
-
-  return true;
-}
-
-bool OpenthermGateway::queue_command(char const *command, std::string const &parameter) {
-  if (_command_queue.size() == MAX_COMMAND_QUEUE_LENGTH) {
-    ESP_LOGE("otgw", "Failed to send %s=%s because the queue is full", command, parameter.c_str());
-    return false;
+#ifdef USE_OTGW_READER_TASK
+int OpenthermGateway::serial_available() { return _use_reader_task ? _received_lines.size() : available(); }
+#else
+int OpenthermGateway::serial_available() { return available(); }
+#endif
+
+int OpenthermGateway::serial_read() {
+#ifdef USE_OTGW_READER_TASK
+  // The reader task owns the UART, reading here would take bytes from the middle of its lines. The
+  // core only reads through read_available(), which takes the lines from the task instead.
+  if (_use_reader_task) {
+    ESP_LOGE("otgw", "The UART can not be read while the reader task is running");
+    return -1;
   }
-
-  _command_queue.push_back(std::string(command) + "=" + parameter + "\r\n");
-  return true;
+#endif
+  return read();
 }
 
-void OpenthermGateway::setup() {
-  // Reset the PIC, useful when it is confused due to serial weirdness during startup
-  esp8266::ESP8266GPIOPin pic_reset;
-  pic_reset.set_pin(D5);
-  pic_reset.set_inverted(false);
-  pic_reset.set_flags(gpio::Flags::FLAG_OUTPUT);
-
-  pic_reset.setup();
-  pic_reset.digital_write(false);
-  write_str("GW=R\r"); // prime for immediate sending
-  delay(100);
-  pic_reset.digital_write(true);
-  pic_reset.pin_mode(gpio::Flags::FLAG_INPUT);
-
-  // Get gateway info
-  queue_command("PR", "A");
-  queue_command("PR", "B");
-  queue_command("PR", "Q");
-
-  // Trigger slave opentherm version requests. We do this to find out when the initialization of
-  // the gateway is done
-  queue_command("KI", SlaveOpenThermVersion::as_str());
-  queue_command("AA", SlaveOpenThermVersion::as_str());
+void OpenthermGateway::serial_write(std::string const &data) {
+  write_str(data.c_str());
+  flush();
 }
 
-void OpenthermGateway::read_available() {
-  while (available()) {
-    char c = read();
-    if (c == -1) {  // Nothing received
-      return;
+#ifdef USE_OTGW_READER_TASK
+void OpenthermGateway::reader_task(void *param) {
+  auto *gateway = static_cast<OpenthermGateway *>(param);
+  char line[MAX_BUFFER_SIZE];
+  uint16_t length = 0;
+  uint64_t time = 0;
+  // Set after an overlong line filled the buffer, until its line end
+  bool discarding = false;
+
+  while (true) {
+    if (!gateway->available()) {
+      vTaskDelay(pdMS_TO_TICKS(READER_TASK_POLL_INTERVAL));
+      continue;
     }
 
-    if (c == '\r') {  // Can be ignored
+    uint8_t c;
+    if (!gateway->read_byte(&c)) {
       continue;
     }
+    if (length == 0) {
+      // millis_64() is not safe to call from another task, this is the same clock on the ESP32
+      time = esp_timer_get_time() / 1000;
+    }
 
-    if (c == '\n') {  // End of the line
-      parse_line(_receive_buffer);
-      _receive_buffer.clear();
+    if (c == '\r') {
+      continue;
+    }
+    if (c == '\n') {
+      if (!discarding) {
+        gateway->push_received_line(line, length, time);
+      }
+      length = 0;
+      discarding = false;
       continue;
     }
+    if (discarding) {
+      continue;
+    }
+    if (length == sizeof(line)) {
+      // Buffer full, the line is passed on to be counted as dropped and the rest of it is skipped up
+      // to its end rather than handled as a line of its own
+      gateway->push_received_line(line, length, time);
+      length = 0;
+      discarding = true;
+      continue;
+    }
+    line[length++] = c;
+  }
+}
+
+void OpenthermGateway::push_received_line(char const *line, uint16_t length, uint64_t time) {
+  ReceivedLine received{time, 0, 0, 0, false, {}};
 
-    if (_receive_buffer.size() == MAX_BUFFER_SIZE) {  // Buffer full
-      _receive_buffer.clear();
+  bool frame = (
+    length == 9 && Transaction::step_from_char(line[0]) &&
+    std::all_of(line + 1, line + 9, [](unsigned char c) { return std::isxdigit(c); })
+  );
+  if (frame) {
+    received.step = line[0];
+    for (uint8_t i = 1; i != 9; ++i) {
+      char c = line[i];
+      received.frame = (received.frame << 4) | (std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10);
     }
+  } else {
+    // Anything else is passed on as text, parse_line() reports what is wrong with it
+    received.truncated = length > received.text.size();
+    received.length = std::min<size_t>(length, received.text.size());
+    std::copy(line, line + received.length, received.text.begin());
+  }
 
-    _receive_buffer += c;
+  if (!_received_lines.push(received)) {
+    _received_lines_dropped.fetch_add(1, std::memory_order_relaxed);
   }
 }
 
-void OpenthermGateway::parse_command_response(std::string const &line) {
-  if (!_send_command) {
-    ESP_LOGE("otgw", "Received unexpected reply (%s).", line.c_str());
+void OpenthermGateway::read_available() {
+  if (!_use_reader_task) {
+    OpenthermGatewayCore::read_available();
     return;
   }
 
-  std::string command_code = line.substr(0, 2);
+  OTGW_PROFILE(READ_AVAILABLE);
+  ReceivedLine received;
+  while (_received_lines.pop(received)) {
+    if (received.truncated) {
+      // The start of a reply could pass for a complete one, so nothing of the line is used
+      ESP_LOGE("otgw", "Dropped a line longer than %u characters", static_cast<unsigned>(received.text.size()));
+      _metrics.dropped_lines++;
+      continue;
+    }
+    if (received.step == 0) {
+      std::string line(received.text.data(), received.length);
+      handle_line(line);
+      parse_line(line);
+      continue;
+    }
 
-  if (command_code == "OE") {
-    if (_command_queue.size() < MAX_COMMAND_QUEUE_LENGTH)
-      _command_queue.push_back(*_send_command);
-    _send_command.reset();
-    return;
+    OTGW_PROFILE(PARSE_LINE);
+#ifdef USE_OTGW_PASSTHROUGH
+    if (_passthrough.is_enabled()) {
+      char line[10];
+      snprintf(line, sizeof(line), "%c%08" PRIX32, received.step, received.frame);
+      handle_line(line);
+    }
+#endif
+    count_line_since_command();
+    // Stamped when the reader task received it
+    handle_frame(*Transaction::step_from_char(received.step), received.frame, received.time, received.time);
   }
 
-  if (is_error(command_code)) {
-    _send_command.reset();
+  _metrics.dropped_lines += _received_lines_dropped.exchange(0, std::memory_order_relaxed);
+}
+#endif
+
+#ifdef USE_OTGW_PASSTHROUGH
+void OpenthermGateway::handle_line(std::string const &line) {
+  _passthrough.push_line(line);
+}
+#endif
+
+void OpenthermGateway::publish_metrics() {
+  uint64_t now = now_ms();
+  if (now >= _time_metrics_published && now - _time_metrics_published < METRICS_INTERVAL) {
     return;
   }
 
-  if (command_code != _send_command->substr(0, 2)) {
-    ESP_LOGE("otgw", "Received reply (%s) that does not match command (%s).", line.c_str(), _send_command->c_str());
-    return;
+  float minutes = (now - _time_metrics_published) / 60'000.0f;
+  if (now < _time_metrics_published) {
+    // Clock has overrun, the frame rate of this period is unknown
+    minutes = 0;
   }
+  _time_metrics_published = now;
+
+  if (minutes > 0) {
+    this->thermostat_frames_per_minute.publish_state(_metrics.frames[Transaction::TH_REQUEST] / minutes);
+    this->gateway_request_frames_per_minute.publish_state(_metrics.frames[Transaction::GA_REQUEST] / minutes);
+    this->boiler_frames_per_minute.publish_state(_metrics.frames[Transaction::CH_RESPONSE] / minutes);
+    this->gateway_response_frames_per_minute.publish_state(_metrics.frames[Transaction::GA_RESPONSE] / minutes);
+    this->command_bytes_per_minute.publish_state(_metrics.command_bytes / minutes);
+  }
+  _metrics.frames.fill(0);
+  _metrics.command_bytes = 0;
+
+  this->parse_errors.publish_state(_metrics.parse_errors);
+  this->transaction_mismatches.publish_state(_metrics.transaction_mismatches);
+  this->command_queue_depth.publish_state(_command_queue.size());
+  this->command_queue_high_water_mark.publish_state(_metrics.command_queue_high_water_mark);
+  this->overrun_errors.publish_state(_metrics.overrun_errors);
+  this->unknown_command_errors.publish_state(_metrics.unknown_command_errors);
+  this->syntax_errors.publish_state(_metrics.syntax_errors);
+  this->dropped_commands.publish_state(_metrics.dropped_commands);
+  this->suppressed_outside_temperature_commands.publish_state(_suppressed_outside_temperature_commands);
+  this->suppressed_time_commands.publish_state(_suppressed_time_commands);
+  this->priority_requests_issued.publish_state(_metrics.priority_requests_issued);
+  this->priority_requests_fulfilled.publish_state(_metrics.priority_requests_fulfilled);
+  this->priority_requests_timed_out.publish_state(_metrics.priority_requests_timed_out);
+  this->dropped_lines.publish_state(_metrics.dropped_lines);
+  this->receive_backlog.publish_state(_metrics.receive_backlog);
+  _metrics.receive_backlog = 0;
+
+  if (_metrics.boiler_responses != 0) {
+    this->boiler_response_time.publish_state(_metrics.boiler_response_time_total / _metrics.boiler_responses);
+    this->max_boiler_response_time.publish_state(_metrics.boiler_response_time_max);
+  }
+  if (_metrics.gateway_delays != 0) {
+    this->gateway_delay.publish_state(_metrics.gateway_delay_total / _metrics.gateway_delays);
+  }
+  _metrics.boiler_response_time_total = 0;
+  _metrics.boiler_response_time_max = 0;
+  _metrics.boiler_responses = 0;
+  _metrics.gateway_delay_total = 0;
+  _metrics.gateway_delays = 0;
+}
 
-  _lines_since_command = 0;
+void OpenthermGateway::setup() {
+  if (_reset_pin != nullptr) {
+    // Reset the PIC, useful when it is confused due to serial weirdness during startup
+    _reset_pin->setup();
+    _reset_pin->digital_write(false);
+    write_str("GW=R\r"); // prime for immediate sending
+    delay(100);
+    _reset_pin->digital_write(true);
+    _reset_pin->pin_mode(gpio::Flags::FLAG_INPUT);
+  } else {
+    write_str("GW=R\r");
+  }
 
-  if (command_code == "PR") {
-    char print_report_code = line.at(4);
-    if (_send_command->at(3) != print_report_code) {
-      ESP_LOGE("otgw", "Received reply (%s) that does not match command (%s).", line.c_str(), _send_command->c_str());
-      return;
-    }
+  begin();
 
-    switch (print_report_code) {
-      case 'A':
-        this->opentherm_gateway_version.publish_state(line.substr(6));
-        break;
-      case 'B':
-        this->opentherm_gateway_build_date.publish_state(line.substr(6));
-        break;
-      case 'Q': {
-        char last_reset_code = line.at(6);
-        switch (last_reset_code) {
-          case 'B':
-            this->last_reset_cause.publish_state("Brown out");
-            break;
-          case 'C':
-            this->last_reset_cause.publish_state("GW=R command");
-            break;
-          case 'E':
-            this->last_reset_cause.publish_state("Reset signal");
-            break;
-          case 'L':
-            this->last_reset_cause.publish_state("Boot loop");
-            break;
-          case 'O':
-            this->last_reset_cause.publish_state("Stack overflow");
-            break;
-          case 'P':
-            this->last_reset_cause.publish_state("Power on");
-            break;
-          case 'S':
-            this->last_reset_cause.publish_state("BREAK condition on serial interface");
-            break;
-          case 'U':
-            this->last_reset_cause.publish_state("Stack underflow");
-            break;
-          case 'W':
-            this->last_reset_cause.publish_state("Watch dog timer");
-            break;
-          default:
-            ESP_LOGW("otgw", "Received unknown last reset code: %c", last_reset_code);
-            break;
-        }
-        break;
+#ifdef USE_OTGW_READER_TASK
+  if (_use_reader_task) {
+    // Above the priority of the loop task, so frames are timestamped and taken from the UART even when
+    // the loop is busy
+    xTaskCreate(reader_task, "otgw_reader", 3072, this, 5, &_reader_task);
+  }
+#endif
+
+#ifdef USE_OTGW_PASSTHROUGH
+  if (_passthrough.is_enabled()) {
+    _passthrough.set_command_callback([this](std::string const &command, std::string const &parameter) {
+      queue_command(command.c_str(), parameter);
+    });
+    _passthrough.setup();
+  }
+#endif
+}
+
+void OpenthermGateway::handle_print_report(char code, std::string const &value) {
+  switch (code) {
+    case 'A':
+      this->opentherm_gateway_version.publish_state(value);
+      break;
+    case 'B':
+      this->opentherm_gateway_build_date.publish_state(value);
+      break;
+    case 'Q': {
+      char last_reset_code = value[0];
+      switch (last_reset_code) {
+        case 'B':
+          this->last_reset_cause.publish_state("Brown out");
+          break;
+        case 'C':
+          this->last_reset_cause.publish_state("GW=R command");
+          break;
+        case 'E':
+          this->last_reset_cause.publish_state("Reset signal");
+          break;
+        case 'L':
+          this->last_reset_cause.publish_state("Boot loop");
+          break;
+        case 'O':
+          this->last_reset_cause.publish_state("Stack overflow");
+          break;
+        case 'P':
+          this->last_reset_cause.publish_state("Power on");
+          break;
+        case 'S':
+          this->last_reset_cause.publish_state("BREAK condition on serial interface");
+          break;
+        case 'U':
+          this->last_reset_cause.publish_state("Stack underflow");
+          break;
+        case 'W':
+          this->last_reset_cause.publish_state("Watch dog timer");
+          break;
+        default:
+          ESP_LOGW("otgw", "Received unknown last reset code: %c", last_reset_code);
+          break;
       }
-      default:
-        ESP_LOGE("otgw", "No code written to process response: %s", line.c_str());
-        break;
+      break;
     }
-  } else if (command_code == "CS") {
+    default:
+      ESP_LOGE("otgw", "No code written to process report %c: %s", code, value.c_str());
+      break;
+  }
+}
+
+void OpenthermGateway::handle_command_reply(std::string const &command_code, std::string const &line) {
+  if (command_code == "CS") {
     if (_heating_circuit_1) {
       // The CS command needs to be given once per minute
-      _heating_circuit_1->_time_of_last_command = millis_64();
+      _heating_circuit_1->_time_of_last_command = now_ms();
     }
   } else if (command_code == "C2") {
     if (_heating_circuit_2) {
       // The C2 command needs to be given once per minute
-      _heating_circuit_2->_time_of_last_command = millis_64();
+      _heating_circuit_2->_time_of_last_command = now_ms();
+    }
+  }
+}
+
+void OpenthermGateway::handle_idle() {
+  update_outside_temperature();
+
+  // At most one refresh per call, so the circuits never fill the queue together
+  if (_heating_circuit_1 && _heating_circuit_1->refresh(*this))
+    return;
+  if (_heating_circuit_2)
+    _heating_circuit_2->refresh(*this);
+}
+
+void OpenthermGateway::handle_gateway_reset() {
+  if (_heating_circuit_1)
+    _heating_circuit_1->reset();
+  if (_heating_circuit_2)
+    _heating_circuit_2->reset();
+  // The overrides are gone, so picking the value shown before the reset has to send it again
+  if (_room_thermostat != nullptr)
+    _room_thermostat->forget_commanded();
+  if (_hot_water != nullptr)
+    _hot_water->forget_commanded();
+
+  // The clock and the outside temperature were lost as well
+  _time_clock_set.reset();
+  if (_time_source != nullptr) {
+    sync_clock();
+  }
+  if (!std::isnan(_outside_temperature_sent)) {
+    if (std::isnan(_outside_temperature_pending)) {
+      _outside_temperature_pending = _outside_temperature_sent;
     }
+    _outside_temperature_sent = NAN;
   }
-  _send_command.reset();
+}
+
+uint64_t OpenthermGateway::idle_deadline() {
+  uint64_t deadline = UINT64_MAX;
+  if (_heating_circuit_1)
+    deadline = std::min(deadline, _heating_circuit_1->next_refresh());
+  if (_heating_circuit_2)
+    deadline = std::min(deadline, _heating_circuit_2->next_refresh());
+  if (!std::isnan(_outside_temperature_pending))
+    deadline = std::min(deadline, _time_outside_temperature_sent + _outside_temperature_interval);
+  return deadline;
+}
+
+void OpenthermGateway::add_custom_sensor(
+  sensor::Sensor *sens, uint8_t data_type, CustomFormat format, uint16_t interval
+) {
+  CustomEntity entity{data_type, format, 0, {}};
+  entity.sensor = sens;
+  add_custom_entity(entity, interval);
+}
+
+void OpenthermGateway::add_custom_binary_sensor(
+  binary_sensor::BinarySensor *sens, uint8_t data_type, uint8_t bit, uint16_t interval
+) {
+  CustomEntity entity{data_type, CustomFormat::FLAG, bit, {}};
+  entity.binary_sensor = sens;
+  add_custom_entity(entity, interval);
+}
+
+void OpenthermGateway::add_custom_entity(CustomEntity const &entity, uint16_t interval) {
+  auto position = std::upper_bound(
+    _custom_entities.begin(), _custom_entities.end(), entity.data_type,
+    [](uint8_t data_type, CustomEntity const &other) { return data_type < other.data_type; }
+  );
+  _custom_entities.insert(position, entity);
+  _custom_data_types.set(entity.data_type);
+  set_interest(entity.data_type, interval);
+}
+
+bool OpenthermGateway::publish_custom(uint8_t data_type, uint16_t data) {
+  if (!_custom_data_types[data_type]) {
+    return false;
+  }
+
+  auto it = std::lower_bound(
+    _custom_entities.begin(), _custom_entities.end(), data_type,
+    [](CustomEntity const &entity, uint8_t data_type) { return entity.data_type < data_type; }
+  );
+  for (; it != _custom_entities.end() && it->data_type == data_type; ++it) {
+    switch (it->format) {
+      case CustomFormat::F88:
+        it->sensor->publish_state(parse_float(data));
+        break;
+      case CustomFormat::U16:
+        it->sensor->publish_state(data);
+        break;
+      case CustomFormat::S16:
+        it->sensor->publish_state(parse_int16(data));
+        break;
+      case CustomFormat::HB:
+        it->sensor->publish_state(data >> 8);
+        break;
+      case CustomFormat::LB:
+        it->sensor->publish_state(data & 0xFF);
+        break;
+      case CustomFormat::FLAG:
+        it->binary_sensor->publish_state((data >> it->bit) & 1);
+        break;
+    }
+  }
+  return true;
 }
 
 bool OpenthermGateway::handle_slave_response(uint8_t data_type, uint16_t data) {
+  bool custom = publish_custom(data_type, data);
+
   uint8_t high_data = (data >> 8) & 0xFF;
   uint8_t low_data = data & 0xFF;
 
@@ -431,12 +656,14 @@ bool OpenthermGateway::handle_slave_response(uint8_t data_type, uint16_t data) {
       this->slave_opentherm_version.publish_state(std::to_string(parse_float(data)));
       break;
     default:
-      return false;
+      return custom;
   }
   return true;
 }
 
 bool OpenthermGateway::handle_master_request(uint8_t data_type, uint16_t data) {
+  bool custom = publish_custom(data_type, data);
+
   switch (data_type) {
     case RoomSetpoint::ID: {
       float temperature = parse_float(data);
@@ -475,7 +702,7 @@ bool OpenthermGateway::handle_master_request(uint8_t data_type, uint16_t data) {
       this->master_opentherm_version.publish_state(std::to_string(parse_float(data)));
       break;
     default:
-      return false;
+      return custom;
   }
   return true;
 }
@@ -497,358 +724,17 @@ bool OpenthermGateway::handle_gateway_response(uint8_t data_type, uint16_t data)
   return true;
 }
 
-void OpenthermGateway::handle_transaction(OpenthermGateway::Transaction const &transaction) {
-  ESP_LOGD("otgw", "Received %d,%d transaction:", transaction.master_data_type, transaction.slave_data_type);
-  for (uint8_t step = 0; step != 4; ++step) {
-    auto message = transaction.data[step];
-    if (message) {
-      ESP_LOGI("otgw", "  %c, %s: %d", Transaction::STEP[step], Transaction::MESSAGE_TYPE[message->message_type], message->data);
-    }
-  }
-
-  bool reusable_master_slot = false;
-  if (
-    _reuse_master_slots && transaction.data[Transaction::TH_REQUEST] &&
-    transaction.data[Transaction::TH_REQUEST]->message_type == Transaction::WRITE_DATA && (
-      transaction.master_data_type == RoomSetpoint::ID ||
-      transaction.master_data_type == RoomSetpoint2::ID ||
-      transaction.master_data_type == RoomTemperature::ID ||
-      transaction.master_data_type == RoomTemperatureCH2::ID ||
-      transaction.master_data_type == MasterOpenThermVersion::ID ||
-      transaction.master_data_type == MasterProductVersion::ID
-    )
-  ) {
-    reusable_master_slot = true;
-  }
-
-  if (transaction.master_data_type != transaction.slave_data_type) {
-    // In this case we are really dealing with two transactions so we split them up
-    if (transaction.slave_data_type == SlaveOpenThermVersion::ID) {
-      _ready_for_requests = true;
-    }
-
-    // We don't support the use of alternatives as it disrupts the algorithm determining when
-    // to send priority messages
-    queue_command("DA", std::to_string(transaction.slave_data_type));
-
-    if (!reusable_master_slot) {
-      auto const &data_type_info = _data_types[transaction.master_data_type];
-      if (data_type_info.interest && data_type_info.supported) {
-        // We are interested but apparently it is marked as unknown
-        queue_command("KI", std::to_string(transaction.master_data_type));
-      }
-    }
-
-    // This was an overriden message. If it was because of a "PM" we can mark the request as done.
-    // If something else caused it it is still a good idea to mark it as done, as we might otherwise
-    // cause the system to wait on a PM response that never comes.
-    _data_type_request.reset();
-
-    auto data = transaction.data;
-    data[Transaction::GA_REQUEST].reset();
-    data[Transaction::CH_RESPONSE].reset();
-    handle_transaction_messages(transaction.master_data_type, data);
-
-    data = transaction.data;
-    data[Transaction::TH_REQUEST].reset();
-    data[Transaction::GA_RESPONSE].reset();
-    handle_transaction_messages(transaction.slave_data_type, data);
-  } else {
-    uint8_t data_type = transaction.master_data_type;
-
-    if (reusable_master_slot) {
-      queue_command("UI", std::to_string(data_type));
-    }
-
-    handle_transaction_messages(data_type, transaction.data);
-  }
-}
-
-void OpenthermGateway::handle_transaction_messages(uint8_t data_type, OpenthermGateway::Transaction::Messages data) {
-  std::optional<bool> read_transaction;
-  bool supported = true;
-  for (uint8_t step = 0; step != 4; ++step) {
-    auto &message = data[step];
-    if (!message) {
-      continue;
-    }
-
-    bool step_request = step <= Transaction::GA_REQUEST;
-    bool message_type_request = message->message_type <= Transaction::RESERVED;
-    if (step_request != message_type_request) {
-      ESP_LOGE("otgw", "Received line message type (%d) and transaction step (%d) does not match", message->message_type, step);
-      return;
-    }
-
-    std::optional<bool> read_message;
-    switch (message->message_type) {
-      case Transaction::READ_DATA:
-        read_message = true;
-        break;
-      case Transaction::WRITE_DATA:
-        read_message = false;
-        break;
-      case Transaction::INVALID_DATA:
-        // This means that this message is required to be sent but not valid
-        // in this particular situation
-        ESP_LOGW("otgw", "MSG %d: invalid data", data_type);
-        return;
-      case Transaction::RESERVED:
-        return;
-
-      case Transaction::READ_ACK:
-        read_message = true;
-        break;
-      case Transaction::WRITE_ACK:
-        read_message = false;
-        break;
-      case Transaction::DATA_INVALID:
-        ESP_LOGW("otgw", "MSG %d: data invalid", data_type);
-        supported = false;
-        break;
-      case Transaction::UNKNOWN_DATAID:
-        if (step != Transaction::GA_RESPONSE) {
-          // This just means the gateway has overriden the request, not really an error
-          ESP_LOGW("otgw", "MSG %d: unknown dataid", data_type);
-          supported = false;
-        }
-        break;
-      default:
-        ESP_LOGE("otgw", "Received unknown message type %d", message->message_type);
-        return;
-    }
-
-    if (read_message) {
-      if (!read_transaction) {
-        read_transaction = read_message;
-      } else if (*read_message != *read_transaction) {
-        ESP_LOGE("otgw",
-          "Received %s transaction contains conflicting message type %d",
-          *read_transaction ? "READ" : "WRITE", message->message_type
-        );
-      }
-    }
-  }
-
-  if (!read_transaction) {
-    ESP_LOGE("otgw", "Couldn't deduce message READ or write from transaction %d", data_type);
-    return;
-  }
-
-  // Count the number of consecutive failures, this will then be used to determine if it should be
-  // reported as unknown
-  DataTypeInfo& info = _data_types[data_type];
-  if (!supported) {
-    info.consecutive_failures = min(info.consecutive_failures + 1, 10);
-  } else {
-    info.consecutive_failures = 0;
-    info.supported = true;
-  }
-
-  if (info.readable_info) {
-    info.readable_info->time_last_received = seconds();
-  }
-  if (_data_type_request && _data_type_request->data_type == data_type) {
-    _data_type_request.reset();
-  }
-
-  // Some data types are commands, the heater will send the value back to the thermostat,
-  // so we can get the relevant data from the heater response
-  bool treat_as_read_transaction = (
-    *read_transaction ||
-    data_type == ControlSetpoint::ID ||
-    data_type == ControlSetpoint2::ID ||
-    data_type == MaxRelativeModulationLevel::ID ||
-    data_type == DHWSetpoint::ID ||
-    data_type == MaxCHWaterSetpoint::ID
-  );
-
-  if (data[Transaction::CH_RESPONSE]) {
-    if ((
-      !info.interest &&
-      // Without these the heating might not function
-      data_type != Status::ID &&
-      data_type != SlaveConfiguration::ID &&
-      data_type != ControlSetpoint::ID &&
-      data_type != ControlSetpoint2::ID &&
-      data_type != BoilerFlowWaterTemperature::ID &&
-      data_type != FlowTemperatureCH2::ID &&
-      data_type != MaxRelativeModulationLevel::ID &&
-      data_type != RelativeModulationLevel::ID &&
-      data_type != RemoteRequest::ID &&
-      data_type != CoolingControl::ID &&
-      (data_type != RemoteOverrideRoomSetpoint::ID || _ignore_heater_overrides) &&
-      (data_type != RemoteOverrideRoomSetpoint2::ID || _ignore_heater_overrides)
-    ) || info.consecutive_failures >= 3) {
-      // Tell the gateway that we are not interested in this data type
-      std::string data_type_as_str = std::to_string(data_type);
-      queue_command("UI", data_type_as_str);
-      queue_command("DA", data_type_as_str);
-      info.supported = false;
-    }
-  }
-
-  if (treat_as_read_transaction) {
-    if (!supported) {
-      return;
-    }
-
-    auto data_value = data[Transaction::CH_RESPONSE];
-    if (data_value) {
-      handle_slave_response(data_type, data_value->data);
-    }
-    data_value = data[Transaction::GA_RESPONSE];
-    if (data_value) {
-      handle_gateway_response(data_type, data_value->data);
-    }
-  } else {
-    auto data_value = data[Transaction::TH_REQUEST];
-    if (data_value) {
-      handle_master_request(data_type, data_value->data);
-    }
-  }
-}
-
-void OpenthermGateway::parse_line(std::string const &line) {
-  ESP_LOGD("otgw", "Received line %s", line.c_str());
-  if (line.size() >= 3 && line[2] == ':') {
-    parse_command_response(line);
-    return;
-  }
-
-  if (_send_command) {
-    if (_lines_since_command > 3) {
-      ESP_LOGE("otgw", "Did not receive a reply to command (%s).", _send_command->c_str());
-      if (_command_queue.size() < MAX_COMMAND_QUEUE_LENGTH)
-        _command_queue.push_back(*_send_command);
-      _send_command.reset();
-    } else {
-      _lines_since_command++;
-    }
-  }
-
-  if (line.size() != 9) {
-    ESP_LOGE("otgw", "Received line (%s) is not 9 characters", line.c_str());
-    return;
-  }
-
-  unsigned long message = strtoul(line.substr(1, 8).c_str(), nullptr, 16);
-  uint8_t message_type = (message >> 28) & 0b0111;
-  uint8_t data_type = (message >> 16) & 0xFF;
-  uint16_t data = message & 0xFFFF;
-  ESP_LOGD("otgw", "  Data type %d: %s", data_type, Transaction::MESSAGE_TYPE[message_type]);
-
-  Transaction::Step transaction_step;
-  switch (line[0]) {
-    case 'T':
-      transaction_step = Transaction::TH_REQUEST;
-      break;
-    case 'R':
-      transaction_step = Transaction::GA_REQUEST;
-      break;
-    case 'B':
-      transaction_step = Transaction::CH_RESPONSE;
-      break;
-    case 'A':
-      transaction_step = Transaction::GA_RESPONSE;
-      break;
-    default:
-      ESP_LOGE("otgw", "Received line (%s) does not start with B, T, R, or A", line.c_str());
-      return;
-  }
-
-  // Check if this is the start of a new transaction
-  if (_current_transaction) {
-    if (transaction_step <= _last_transaction_step) {
-      handle_transaction(*_current_transaction);
-      _current_transaction.reset();
-    } else if (
-      transaction_step == Transaction::CH_RESPONSE &&
-      _current_transaction->slave_data_type != data_type
-    ) {
-      _current_transaction.reset();
-      ESP_LOGE("otgw", "Type of line (%s) does not match that of transaction (%d)", line.c_str(), _current_transaction->slave_data_type);
-    } else if (
-      transaction_step == Transaction::GA_RESPONSE &&
-      _current_transaction->master_data_type != data_type
-    ) {
-      _current_transaction.reset();
-      ESP_LOGE("otgw", "Type of line (%s) does not match that of transaction (%d)", line.c_str(), _current_transaction->master_data_type);
-    }
-  }
-
-  // If this is a new transaction
-  if (!_current_transaction && transaction_step <= Transaction::GA_REQUEST) {
-    _current_transaction = Transaction{};
-    _current_transaction->slave_data_type = data_type;
-    _current_transaction->master_data_type = data_type;
-  }
-
-  if (_current_transaction) {
-    // The gateway can change the request to slot in for an unknown dataid
-    if (transaction_step == Transaction::GA_REQUEST) {
-      _current_transaction->slave_data_type = data_type;
-    }
-
-    _current_transaction->data[transaction_step] = Transaction::Message{Transaction::MessageType{message_type}, data};
-  }
-
-  _last_transaction_step = transaction_step;
-}
-
 void OpenthermGateway::loop() {
-  if (!_send_command && !_command_queue.empty()) {
-    _send_command = _command_queue[0];
-    _command_queue.erase(_command_queue.begin());
-    ESP_LOGD("otgw", "> %s", _send_command->c_str());
-    write_str(_send_command->c_str());
-    flush();
-  } else if (!_send_command) { // Means queue is empty
-    uint32_t current_time = seconds();
-
-    // We do this here to avoid spamming the queue
-    if (_heating_circuit_1)
-      _heating_circuit_1->refresh(*this);
-    if (_heating_circuit_2)
-      _heating_circuit_2->refresh(*this);
-
-    if (_data_type_request) {
-      if (
-        _data_type_request->time_of_request + DATA_TYPE_REQUEST_TIMEOUT < current_time ||
-        _data_type_request->time_of_request > current_time // clock overflow
-      ) {
-        ESP_LOGD("otgw", "Did not receive data after PM=%d command", _data_type_request->data_type);
-        _data_type_request.reset();
-      }
-    } else if (_ready_for_requests) {
-      std::optional<DataTypeRequest> most_outdated_data_type;
-      for (auto &item : _data_types) {
-        if (!item.second.interest || !item.second.supported || !item.second.readable_info) {
-          continue;
-        }
-
-        auto time_last_received = item.second.readable_info->time_last_received;
-        if (!time_last_received) {
-          most_outdated_data_type = DataTypeRequest{item.first, current_time};
-          break;
-        }
-
-        auto time_of_next_request = *time_last_received + item.second.readable_info->interval * 60;
-        if (!most_outdated_data_type || time_of_next_request < most_outdated_data_type->time_of_request) {
-          most_outdated_data_type = DataTypeRequest{item.first, time_of_next_request};
-        }
-      }
-
-      if (most_outdated_data_type) {
-        uint8_t data_type = most_outdated_data_type->data_type;
-
-        _data_type_request = DataTypeRequest{data_type, current_time};
-        queue_command("PM", std::to_string(data_type));
-      }
-    }
-  }
+  OTGW_PROFILE(LOOP);
+  process();
+#ifdef USE_OTGW_PASSTHROUGH
+  _passthrough.loop();
+#endif
+  publish_metrics();
+}
 
-  read_available();
+void OpenthermGateway::set_reset_pin(GPIOPin *pin) {
+  _reset_pin = pin;
 }
 
 void OpenthermGateway::set_room_thermostat(OpenthermGatewayClimate *clim) {
@@ -943,34 +829,99 @@ void OpenthermGateway::set_heating_circuit_2(OpenthermGatewayWaterHeater *water_
   set_interest<CHSetpointBounds>();
 }
 
-void OpenthermGateway::reuse_master_slots(bool reuse_slots) {
-  _reuse_master_slots = reuse_slots;
-}
-
-void OpenthermGateway::ignore_heater_overrides(bool ignore_overrides) {
-  _ignore_heater_overrides = ignore_overrides;
-}
 
 void OpenthermGateway::set_outside_temperature_override(sensor::Sensor *sens) {
   _outside_temperature_override = sens;
   _outside_temperature_override->add_on_state_callback([this](float temperature) {
-    char parameter[6];
-    sprintf(parameter, "%2.2f", temperature);
+    if (std::isnan(temperature)) {
+      return;
+    }
 
-    queue_command("OT", parameter);
+    if (!std::isnan(_outside_temperature_pending)) {
+      // Replaced before it was sent
+      _suppressed_outside_temperature_commands++;
+    }
+    _outside_temperature_pending = temperature;
+    update_outside_temperature();
   });
 }
 
+void OpenthermGateway::update_outside_temperature() {
+  if (std::isnan(_outside_temperature_pending)) {
+    return;
+  }
+
+  if (
+    !std::isnan(_outside_temperature_sent) &&
+    std::fabs(_outside_temperature_pending - _outside_temperature_sent) < _outside_temperature_deadband
+  ) {
+    _outside_temperature_pending = NAN;
+    _suppressed_outside_temperature_commands++;
+    return;
+  }
+
+  uint64_t now = now_ms();
+  // Still waiting for the interval, the value is sent from handle_idle() once it passed
+  if (
+    !std::isnan(_outside_temperature_sent) &&
+    now >= _time_outside_temperature_sent &&
+    now - _time_outside_temperature_sent < _outside_temperature_interval
+  ) {
+    return;
+  }
+
+  char parameter[8];
+  snprintf(parameter, sizeof(parameter), "%2.2f", _outside_temperature_pending);
+  if (queue_command("OT", parameter)) {
+    _outside_temperature_sent = _outside_temperature_pending;
+    _time_outside_temperature_sent = now;
+  }
+  _outside_temperature_pending = NAN;
+}
+
 void OpenthermGateway::set_time_source(time::RealTimeClock *time) {
   _time_source = time;
   _time_source->add_on_time_sync_callback([this]() {
-    auto now = _time_source->now();
+    sync_clock();
+  });
+}
 
-    char parameter[12];
-    sprintf(parameter, "%02d:%02d/%d", now.hour, now.minute, now.day_of_week);
+void OpenthermGateway::sync_clock() {
+  auto now = _time_source->now();
+  if (!now.is_valid()) {
+    return;
+  }
 
-    queue_command("SC", parameter);
-  });
+  uint64_t uptime = now_ms();
+  int32_t time_of_week = seconds_of_week(now);
+  // The clock of the PIC drifts on its own, so the estimate is only trusted for a while
+  if (_time_clock_set && uptime >= *_time_clock_set && uptime - *_time_clock_set < CLOCK_MAX_AGE) {
+    // The gateway keeps time from the moment it was set
+    int32_t gateway_time = (_clock_set_to + (uptime - *_time_clock_set) / 1000) % SECONDS_PER_WEEK;
+    int32_t drift = std::abs(time_of_week - gateway_time);
+    drift = std::min(drift, SECONDS_PER_WEEK - drift);
+    if (static_cast<uint32_t>(drift) <= _time_sync_tolerance) {
+      _suppressed_time_commands++;
+      return;
+    }
+  }
+
+  // SC has no seconds, rounding to the nearest minute keeps the gateway within 30 seconds
+  int32_t minute = (time_of_week + 30) / 60 % (SECONDS_PER_WEEK / 60);
+  char parameter[12];
+  snprintf(parameter, sizeof(parameter), "%02d:%02d/%d", static_cast<int>(minute / 60 % 24),
+           static_cast<int>(minute % 60), static_cast<int>(minute / (24 * 60) + 1));
+
+  if (queue_command("SC", parameter)) {
+    _clock_set_to = minute * 60;
+    _time_clock_set = uptime;
+  }
+}
+
+int32_t OpenthermGateway::seconds_of_week(ESPTime const &time) {
+  // ESPTime starts the week on Sunday (1), the gateway on Monday (SC day 1)
+  int32_t day = (time.day_of_week + 5) % 7;
+  return ((day * 24 + time.hour) * 60 + time.minute) * 60 + time.second;
 }
 
 void OpenthermGateway::set_reset_service_request_button(OpenthermGatewayButton *butt) {
@@ -988,5 +939,29 @@ void OpenthermGateway::set_hot_water_push_button(OpenthermGatewayButton *butt) {
   });
 }
 
+void OpenthermGateway::set_dump_statistics_button(OpenthermGatewayButton *butt) {
+  _dump_statistics = butt;
+  _dump_statistics->set_callback([this]() {
+    dump_statistics();
+  });
+}
+
+void OpenthermGateway::set_dump_trace_button(OpenthermGatewayButton *butt) {
+  _dump_trace = butt;
+  _dump_trace->set_callback([this]() {
+    dump_trace();
+  });
+}
+
+#ifdef USE_OTGW_PASSTHROUGH
+void OpenthermGateway::set_passthrough_port(uint16_t port) {
+  _passthrough.set_port(port);
+}
+
+void OpenthermGateway::set_passthrough_buffer_size(uint16_t size) {
+  _passthrough.set_buffer_size(size);
+}
+#endif
+
 }  // namespace otgw
 }  // namespace esphome
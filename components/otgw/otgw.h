@@ -4,24 +4,30 @@
 #include "water_heater.h"
 #include "button.h"
 #include "data_types.h"
+#include "otgw_core.h"
+#include "passthrough.h"
+#include "spsc_ring.h"
+#include "esphome/core/gpio.h"
+#include "esphome/core/helpers.h"
 #include "esphome/components/uart/uart.h"
 #include "esphome/components/sensor/sensor.h"
 #include "esphome/components/text_sensor/text_sensor.h"
 #include "esphome/components/binary_sensor/binary_sensor.h"
 #include "esphome/components/time/real_time_clock.h"
 
+#include <cstring>
 #include <string>
 #include <bitset>
 #include <vector>
 
+#ifdef USE_OTGW_READER_TASK
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
 namespace esphome {
 namespace otgw {
 
-// Rollover of 139 years, should be plenty
-inline uint32_t seconds() {
-  return millis_64() / 1000;
-}
-
 template<typename ComponentType>
 class OptionalComponent {
  protected:
@@ -40,53 +46,19 @@ class OptionalComponent {
 template<typename ComponentType, typename DataType>
 class OptionalOTComponent : public OptionalComponent<ComponentType> {};
 
-class OpenthermGateway : public Component, public uart::UARTDevice {
- protected:
-
-  struct Transaction {
-    enum Step : uint8_t {
-      TH_REQUEST = 0,
-      GA_REQUEST = 1,
-      CH_RESPONSE = 2,
-      GA_RESPONSE = 3,
-    };
-    constexpr static std::array<char, 4> STEP{'T', 'R', 'B', 'A'};
-
-    enum MessageType : uint8_t {
-      // Request
-      READ_DATA = 0b0000,
-      WRITE_DATA = 0b0001,
-      INVALID_DATA = 0b0010,
-      RESERVED = 0b0011,
-
-      // Response
-      READ_ACK = 0b0100,
-      WRITE_ACK = 0b0101,
-      DATA_INVALID = 0b0110,
-      UNKNOWN_DATAID = 0b0111,
-    };
-    constexpr static std::array<char const *, 8> MESSAGE_TYPE{
-      "READ_DATA",
-      "WRITE_DATA",
-      "INVALID_DATA",
-      "RESERVED",
-      "READ_ACK",
-      "WRITE_ACK",
-      "DATA_INVALID",
-      "UNKNOWN_DATAID",
-    };
-    uint8_t master_data_type = 0;
-    uint8_t slave_data_type = 0;
-    struct Message {
-      MessageType message_type;
-      uint16_t data;
-    };
-    using Messages = std::array<std::optional<Message>, 4>;
-    Messages data;
-  };
-  std::optional<Transaction> _current_transaction;
-  Transaction::Step _last_transaction_step;
+// How the value of a data type declared in YAML is decoded
+enum class CustomFormat : uint8_t {
+  F88,  // Signed fixed point, 8 fractional bits
+  U16,
+  S16,
+  HB,   // Unsigned high byte
+  LB,   // Unsigned low byte
+  FLAG, // A single bit, for binary sensors
+};
 
+// Maps the values decoded by the protocol core to ESPHome entities
+class OpenthermGateway : public Component, public uart::UARTDevice, public OpenthermGatewayCore {
+ protected:
   // Heater circuit 1 and 2 are very similar, so we reuse their behaviour
   // using this struct
   struct HeatingCircuit {
@@ -94,56 +66,110 @@ class OpenthermGateway : public Component, public uart::UARTDevice {
     OpenthermGatewayWaterHeater *_component;
     const char *_temp_command;
     const char *_enable_command;
+    // Whether the circuit was last enabled through the enable command
+    bool _enabled = false;
+    // Whether the enable command was sent at all, the gateway keeps it until the setpoint is cleared
+    bool _enable_sent = false;
+    // Last parameter of the temperature command, so a refresh does not need to format it again
+    char _temperature[8] = "";
+    // Drawn again on every refresh, so two circuits set in the same loop drift apart
+    uint32_t _refresh_interval = REFRESH_INTERVAL;
 
     void set_target(OpenthermGateway &gateway);
     void set_mode(OpenthermGateway &gateway);
     void set_callbacks(OpenthermGateway &gateway);
-    void refresh(OpenthermGateway &gateway);
+    bool refresh(OpenthermGateway &gateway);
+    void queue_temperature(OpenthermGateway &gateway);
+    void queue_enable(OpenthermGateway &gateway);
+    void reset();
+    uint64_t next_refresh() const { return _time_of_last_command + _refresh_interval + 1; }
+
+    // The gateway drops the setpoint when it is not repeated within a minute
+    static constexpr uint32_t REFRESH_INTERVAL = 50'000;
+    static constexpr uint32_t REFRESH_JITTER = 5'000;
   };
 
-  // Information to keep track of which data types are available
-  struct DataTypeInfo {
-    struct ReadableInfo {
-      uint16_t interval;
-      std::optional<uint32_t> time_last_received;
-    };
-    std::optional<ReadableInfo> readable_info;
+  uint64_t _time_metrics_published = 0;
+  static constexpr uint32_t METRICS_INTERVAL = 60'000;
 
-    uint8_t consecutive_failures = 0;
-    bool interest = false;
-    bool supported = true;
-  };
-  std::unordered_map<uint8_t, DataTypeInfo> _data_types;
-
-  template<typename DataType>
-  void set_interest() {
-    auto &data_type_info = _data_types[DataType::ID];
-    data_type_info.interest = true;
-    if constexpr (DataType::INTERVAL != 0) {
-      data_type_info.readable_info = DataTypeInfo::ReadableInfo{DataType::INTERVAL, std::nullopt};
-    }
-  }
-
-  struct DataTypeRequest {
-    uint8_t data_type;
-    uint32_t time_of_request;
-  };
-  std::optional<DataTypeRequest> _data_type_request;
-  bool _ready_for_requests = false;
-  static constexpr uint32_t DATA_TYPE_REQUEST_TIMEOUT = 5 * 60;
+  GPIOPin *_reset_pin{nullptr};
 
   ///// Components /////
   OpenthermGatewayClimate *_room_thermostat{nullptr};
   OpenthermGatewayWaterHeater *_hot_water{nullptr};
   OpenthermGatewayButton *_reset_service_request{nullptr};
   OpenthermGatewayButton *_hot_water_push{nullptr};
+  OpenthermGatewayButton *_dump_statistics{nullptr};
+  OpenthermGatewayButton *_dump_trace{nullptr};
   std::optional<HeatingCircuit> _heating_circuit_1;
   std::optional<HeatingCircuit> _heating_circuit_2;
 
-  bool _reuse_master_slots;
-  bool _ignore_heater_overrides;
   sensor::Sensor *_outside_temperature_override{nullptr};
+  // OT is only sent for changes of at least the deadband, and at most once per interval
+  float _outside_temperature_deadband = 0.2;
+  uint32_t _outside_temperature_interval = 60'000;
+  float _outside_temperature_sent = NAN;
+  // Newest value waiting for the interval to pass
+  float _outside_temperature_pending = NAN;
+  uint64_t _time_outside_temperature_sent = 0;
+  uint32_t _suppressed_outside_temperature_commands = 0;
+
   time::RealTimeClock *_time_source{nullptr};
+  // SC is only sent when the clock of the gateway would be off by more than this many seconds
+  uint32_t _time_sync_tolerance = 60;
+  // The time of the week the clock was set to and when, from which the clock of the gateway is estimated
+  int32_t _clock_set_to = 0;
+  std::optional<uint64_t> _time_clock_set;
+  uint32_t _suppressed_time_commands = 0;
+  static constexpr int32_t SECONDS_PER_WEEK = 7 * 24 * 60 * 60;
+  // SC is sent again after this long even when the estimate says the clock is still right
+  static constexpr uint32_t CLOCK_MAX_AGE = 24 * 60 * 60 * 1000;
+
+#ifdef USE_OTGW_PASSTHROUGH
+  PassthroughServer _passthrough;
+#endif
+
+#ifdef USE_OTGW_READER_TASK
+  // Lines framed by the reader task, handled in loop()
+  struct ReceivedLine {
+    uint64_t time;
+    uint32_t frame;
+    // T, R, B or A for frames, 0 for other lines, e.g. command replies, which are kept in text
+    char step;
+    uint8_t length;
+    // Longer than text, which holds every reply and the banner. Such lines are dropped, not parsed.
+    bool truncated;
+    std::array<char, 32> text;
+  };
+  // Set per gateway, the define only compiles the task in
+  bool _use_reader_task = false;
+  SpscRing<ReceivedLine, 64> _received_lines;
+  std::atomic<uint32_t> _received_lines_dropped{0};
+  TaskHandle_t _reader_task{nullptr};
+  // Time between polls of the UART when nothing was received
+  static constexpr uint32_t READER_TASK_POLL_INTERVAL = 5;
+
+  static void reader_task(void *param);
+  void push_received_line(char const *line, uint16_t length, uint64_t time);
+  void read_available() override;
+#endif
+
+  // Entities for data types declared in YAML, sorted by data type. These are decoded from this table
+  // rather than by the switches for the known data types.
+  struct CustomEntity {
+    uint8_t data_type;
+    CustomFormat format;
+    uint8_t bit;
+    union {
+      sensor::Sensor *sensor;
+      binary_sensor::BinarySensor *binary_sensor;
+    };
+  };
+  std::vector<CustomEntity> _custom_entities;
+  std::bitset<256> _custom_data_types;
+
+  void add_custom_entity(CustomEntity const &entity, uint16_t interval);
+  bool publish_custom(uint8_t data_type, uint16_t data);
 
  public:
   template<typename SensorType, typename DataType>
@@ -157,6 +183,10 @@ class OpenthermGateway : public Component, public uart::UARTDevice {
     var.set(sens);
   }
 
+  // Interval in minutes, like set_interest()
+  void add_custom_sensor(sensor::Sensor *sens, uint8_t data_type, CustomFormat format, uint16_t interval);
+  void add_custom_binary_sensor(binary_sensor::BinarySensor *sens, uint8_t data_type, uint8_t bit, uint16_t interval);
+
   OptionalOTComponent<text_sensor::TextSensor, data_types::SlaveOpenThermVersion> slave_opentherm_version;
   OptionalOTComponent<text_sensor::TextSensor, data_types::MasterOpenThermVersion> master_opentherm_version;
   OptionalComponent<text_sensor::TextSensor> opentherm_gateway_version;
@@ -249,83 +279,142 @@ class OpenthermGateway : public Component, public uart::UARTDevice {
   OptionalOTComponent<sensor::Sensor, data_types::FlameCurrent> flame_current;
   OptionalOTComponent<sensor::Sensor, data_types::RelativeHumidity> relative_humidity;
 
+  // Diagnostics
+  OptionalComponent<sensor::Sensor> thermostat_frames_per_minute;
+  OptionalComponent<sensor::Sensor> gateway_request_frames_per_minute;
+  OptionalComponent<sensor::Sensor> boiler_frames_per_minute;
+  OptionalComponent<sensor::Sensor> gateway_response_frames_per_minute;
+  OptionalComponent<sensor::Sensor> command_bytes_per_minute;
+  OptionalComponent<sensor::Sensor> parse_errors;
+  OptionalComponent<sensor::Sensor> transaction_mismatches;
+  OptionalComponent<sensor::Sensor> dropped_lines;
+  OptionalComponent<sensor::Sensor> command_queue_depth;
+  OptionalComponent<sensor::Sensor> command_queue_high_water_mark;
+  OptionalComponent<sensor::Sensor> overrun_errors;
+  OptionalComponent<sensor::Sensor> unknown_command_errors;
+  OptionalComponent<sensor::Sensor> syntax_errors;
+  OptionalComponent<sensor::Sensor> dropped_commands;
+  OptionalComponent<sensor::Sensor> suppressed_outside_temperature_commands;
+  OptionalComponent<sensor::Sensor> suppressed_time_commands;
+  OptionalComponent<sensor::Sensor> priority_requests_issued;
+  OptionalComponent<sensor::Sensor> priority_requests_fulfilled;
+  OptionalComponent<sensor::Sensor> priority_requests_timed_out;
+  OptionalComponent<sensor::Sensor> receive_backlog;
+  OptionalComponent<sensor::Sensor> boiler_response_time;
+  OptionalComponent<sensor::Sensor> max_boiler_response_time;
+  OptionalComponent<sensor::Sensor> gateway_delay;
+
+  void set_reset_pin(GPIOPin *pin);
   void set_room_thermostat(OpenthermGatewayClimate *clim);
   void set_hot_water(OpenthermGatewayWaterHeater *water_heater);
   void set_heating_circuit_1(OpenthermGatewayWaterHeater *water_heater);
   void set_heating_circuit_2(OpenthermGatewayWaterHeater *water_heater);
   void set_outside_temperature_override(sensor::Sensor *sens);
+  void set_outside_temperature_deadband(float deadband) { _outside_temperature_deadband = deadband; }
+  void set_outside_temperature_interval(uint32_t interval) { _outside_temperature_interval = interval; }
   void set_time_source(time::RealTimeClock *time);
+  void set_time_sync_tolerance(uint32_t tolerance) { _time_sync_tolerance = tolerance; }
   void set_reset_service_request_button(OpenthermGatewayButton *butt);
   void set_hot_water_push_button(OpenthermGatewayButton *butt);
-
-  void reuse_master_slots(bool reuse_slots);
-  void ignore_heater_overrides(bool ignore_overrides);
+  void set_dump_statistics_button(OpenthermGatewayButton *butt);
+  void set_dump_trace_button(OpenthermGatewayButton *butt);
+#ifdef USE_OTGW_READER_TASK
+  void set_reader_task(bool enable) { _use_reader_task = enable; }
+#endif
+#ifdef USE_OTGW_PASSTHROUGH
+  void set_passthrough_port(uint16_t port);
+  void set_passthrough_buffer_size(uint16_t size);
+#endif
 
  protected:
-  static constexpr uint16_t MAX_BUFFER_SIZE = 128;
-  std::string _receive_buffer;
-
-  static constexpr uint16_t MAX_COMMAND_QUEUE_LENGTH = 20;
-  std::vector<std::string> _command_queue;
-  std::optional<std::string> _send_command;
-  uint16_t _lines_since_command = 0;
-
-  void read_available();
-  float parse_float(uint16_t data);
-  int16_t parse_int16(uint16_t data);
-  int8_t parse_int8(uint8_t data);
-  bool is_error(std::string const &command_code);
-  bool queue_command(char const *command, std::string const &parameter);
-  void parse_command_response(std::string const &line);
-  void handle_transaction(Transaction const &transaction);
-  void handle_transaction_messages(uint8_t data_type, Transaction::Messages data);
-  bool handle_slave_response(uint8_t data_type, uint16_t data);
-  bool handle_master_request(uint8_t data_type, uint16_t data);
-  bool handle_gateway_response(uint8_t data_type, uint16_t data);
-  void parse_line(std::string const &line);
+  int serial_available() override;
+  int serial_read() override;
+  void serial_write(std::string const &data) override;
+
+#ifdef USE_OTGW_PASSTHROUGH
+  void handle_line(std::string const &line) override;
+#endif
+
+  bool handle_slave_response(uint8_t data_type, uint16_t data) override;
+  bool handle_master_request(uint8_t data_type, uint16_t data) override;
+  bool handle_gateway_response(uint8_t data_type, uint16_t data) override;
+  void handle_print_report(char code, std::string const &value) override;
+  void handle_command_reply(std::string const &command_code, std::string const &line) override;
+  void handle_idle() override;
+  uint64_t idle_deadline() override;
+  void handle_gateway_reset() override;
+
+  void publish_metrics();
+  void update_outside_temperature();
+  void sync_clock();
+  // Seconds since the start of the week (Monday) in local time, the clock of the gateway only knows the day of the week
+  static int32_t seconds_of_week(ESPTime const &time);
 
   bool set_room_setpoint(float temperature);
   bool set_water_heater_target_temperature(std::optional<HeatingCircuit> &heating_circuit, float temperature);
 
  public:
-  OpenthermGateway(uart::UARTComponent *parent) : uart::UARTDevice(parent) {
-    _receive_buffer.reserve(MAX_BUFFER_SIZE);
-    _command_queue.reserve(MAX_COMMAND_QUEUE_LENGTH);
-  }
+  OpenthermGateway(uart::UARTComponent *parent) : uart::UARTDevice(parent), OpenthermGatewayCore(millis_64) {}
 
   void setup() override;
   void loop() override;
 };
 
 inline void OpenthermGateway::HeatingCircuit::set_target(OpenthermGateway &gateway) {
-  char parameter[6];
+  if (!_component->is_on()) {
+    return;
+  }
 
-  if (_component->is_on()) {
-    // Do not go below 5 to avoid control being given back to the thermostat
-    sprintf(parameter, "%2.2f", max(_component->get_target_temperature(), 5.0f));
-    gateway.queue_command(_temp_command, parameter);
+  if (_enabled) {
+    queue_temperature(gateway);
+  } else {
+    // Nothing was sent yet, so the circuit needs enabling as well
+    set_mode(gateway);
   }
 }
 
 inline void OpenthermGateway::HeatingCircuit::set_mode(OpenthermGateway &gateway) {
-  char parameter[6];
-
-  if (_component->is_on()) {
-    if (!std::isnan(_component->get_target_temperature())) {
-      float target_temperature = _component->get_target_temperature();
-      if (target_temperature == 0) {
-        gateway.queue_command(_temp_command, "0");
-      } else {
-        char parameter[6];
-        sprintf(parameter, "%2.2f", max(target_temperature, 5.0f));
-        gateway.queue_command(_temp_command, parameter);
-      }
-    }
-    gateway.queue_command(_enable_command, "1");
+  // Switching between modes that are both on needs no commands
+  if (_component->is_on() && _enabled) {
+    return;
+  }
+
+  queue_temperature(gateway);
+  queue_enable(gateway);
+}
+
+inline void OpenthermGateway::HeatingCircuit::queue_temperature(OpenthermGateway &gateway) {
+  if (!_component->is_on()) {
+    strcpy(_temperature, "5.00");
   } else {
-    gateway.queue_command(_temp_command, "5.00");
-    gateway.queue_command(_enable_command, "0");
+    float target_temperature = _component->get_target_temperature();
+    if (std::isnan(target_temperature)) {
+      _temperature[0] = '\0';
+      return;
+    }
+
+    if (target_temperature == 0) {
+      strcpy(_temperature, "0");
+    } else {
+      // Do not go below 5 to avoid control being given back to the thermostat
+      snprintf(_temperature, sizeof(_temperature), "%2.2f", max(target_temperature, 5.0f));
+    }
   }
+  gateway.queue_command(_temp_command, _temperature);
+}
+
+inline void OpenthermGateway::HeatingCircuit::queue_enable(OpenthermGateway &gateway) {
+  _enabled = _component->is_on();
+  _enable_sent = true;
+  gateway.queue_command(_enable_command, _enabled ? "1" : "0");
+}
+
+inline void OpenthermGateway::HeatingCircuit::reset() {
+  // The gateway forgot the enable command as well as the setpoint, the next refresh sends both
+  _enabled = false;
+  _enable_sent = false;
+  _time_of_last_command = 0;
+  _component->forget_commanded();
 }
 
 inline void OpenthermGateway::HeatingCircuit::set_callbacks(OpenthermGateway &gateway) {
@@ -336,16 +425,33 @@ inline void OpenthermGateway::HeatingCircuit::set_callbacks(OpenthermGateway &ga
   });
 }
 
-inline void OpenthermGateway::HeatingCircuit::refresh(OpenthermGateway &gateway) {
-  uint64_t now = millis_64();
+inline bool OpenthermGateway::HeatingCircuit::refresh(OpenthermGateway &gateway) {
+  uint64_t now = gateway.now_ms();
   if (
     // This means the clock has overrun
-    now < _time_of_last_command ||
+    now >= _time_of_last_command &&
     // Refresh is needed at least every minute
-    now - _time_of_last_command > 50'000
+    now - _time_of_last_command <= _refresh_interval
   ) {
-    set_mode(gateway);
+    return false;
+  }
+
+  // The reply to the command moves this again, this only keeps a lost reply from resending every loop
+  _time_of_last_command = now;
+  _refresh_interval = REFRESH_INTERVAL - random_uint32() % REFRESH_JITTER;
+
+  if (!_enable_sent) {
+    queue_temperature(gateway);
+    queue_enable(gateway);
+    return true;
+  }
+
+  // Only the setpoint times out, and there is nothing to keep alive when the override is cleared
+  if (_temperature[0] == '\0' || strcmp(_temperature, "0") == 0) {
+    return false;
   }
+  gateway.queue_command(_temp_command, _temperature);
+  return true;
 }
 
 }  // namespace otgw
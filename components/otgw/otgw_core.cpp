@@ -0,0 +1,1242 @@
+#include "otgw_core.h"
+#include "otgw_log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+
+namespace esphome {
+namespace otgw {
+
+using namespace data_types;
+
+// Layout of the summary report of firmware 4.x and 5.x
+const std::array<OpenthermGatewayCore::SummaryField, 25> OpenthermGatewayCore::SUMMARY_FIELDS{{
+  {Status::ID, SummaryFormat::FLAGS, false},
+  {ControlSetpoint::ID, SummaryFormat::F88, false},
+  {RemoteParameters::ID, SummaryFormat::FLAGS, false},
+  {MaxRelativeModulationLevel::ID, SummaryFormat::F88, false},
+  {MaxBoilerCapMinModulationLevel::ID, SummaryFormat::BYTES, false},
+  {RoomSetpoint::ID, SummaryFormat::F88, true},
+  {RelativeModulationLevel::ID, SummaryFormat::F88, false},
+  {CHWaterPressure::ID, SummaryFormat::F88, false},
+  {RoomTemperature::ID, SummaryFormat::F88, true},
+  {BoilerFlowWaterTemperature::ID, SummaryFormat::F88, false},
+  {DHWTemperature::ID, SummaryFormat::F88, false},
+  {OutsideTemperature::ID, SummaryFormat::F88, false},
+  {ReturnWaterTemperature::ID, SummaryFormat::F88, false},
+  {DHWSetpointBounds::ID, SummaryFormat::BYTES, false},
+  {CHSetpointBounds::ID, SummaryFormat::BYTES, false},
+  {DHWSetpoint::ID, SummaryFormat::F88, false},
+  {MaxCHWaterSetpoint::ID, SummaryFormat::F88, false},
+  {SuccessfulBurnerStarts::ID, SummaryFormat::U16, false},
+  {CHPumpStarts::ID, SummaryFormat::U16, false},
+  {DHWPumpStarts::ID, SummaryFormat::U16, false},
+  {DHWBurnerStarts::ID, SummaryFormat::U16, false},
+  {BurnerOperationHours::ID, SummaryFormat::U16, false},
+  {CHPumpOperationHours::ID, SummaryFormat::U16, false},
+  {DHWPumpOperationHours::ID, SummaryFormat::U16, false},
+  {DHWBurnerOperationHours::ID, SummaryFormat::U16, false},
+}};
+
+float OpenthermGatewayCore::parse_float(uint16_t data) { return ((data & 0x8000) ? -(0x10000L - data) : data) / 256.0f; }
+
+int16_t OpenthermGatewayCore::parse_int16(uint16_t data) { return *reinterpret_cast<int16_t *>(&data); }
+
+int8_t OpenthermGatewayCore::parse_int8(uint8_t data) { return *reinterpret_cast<int8_t *>(&data); }
+
+// From the command lists of the firmware releases
+const std::array<OpenthermGatewayCore::FirmwareCapabilities, 3> OpenthermGatewayCore::KNOWN_FIRMWARES{{
+  {3, 0, ALTERNATIVES | SUMMARY},
+  {4, 0, PRIORITY_MESSAGE | UNKNOWN_IDS | ALTERNATIVES | SUMMARY},
+  {5, 0, PRIORITY_MESSAGE | UNKNOWN_IDS | ALTERNATIVES | SUMMARY | SECOND_CIRCUIT},
+}};
+
+bool OpenthermGatewayCore::is_error_code(std::string const &command_code) {
+  return (
+    command_code == "NG" || command_code == "SE" || command_code == "BV" || command_code == "OR" ||
+    command_code == "NS" || command_code == "NF" || command_code == "OE"
+  );
+}
+
+bool OpenthermGatewayCore::is_error(std::string const &command_code) {
+  if (command_code == "NG")
+    ESP_LOGE("otgw", "The command code is unknown.");
+  else if (command_code == "SE")
+    ESP_LOGE("otgw", "The command contained an unexpected character or was incomplete.");
+  else if (command_code == "BV")
+    ESP_LOGE("otgw", "The command contained a data value that is not allowed.");
+  else if (command_code == "OR")
+    ESP_LOGE("otgw", "A number was specified outside of the allowed range.");
+  else if (command_code == "NS")
+    ESP_LOGE("otgw", "The alternative Data-ID could not be added because the table is full.");
+  else if (command_code == "NF")
+    ESP_LOGI("otgw", "The specified alternative Data-ID could not be removed because it does not exist in the table.");
+  else if (command_code == "OE")
+    ESP_LOGE("otgw", "The processor was busy and failed to process all received characters.");
+  else
+    return false;
+
+  return true;
+}
+
+bool OpenthermGatewayCore::queue_command(char const *command, std::string const &parameter) {
+  uint8_t capability = capability_of(command);
+  if (capability != 0 && !(_capabilities & capability)) {
+    ESP_LOGD("otgw", "Skipped %s=%s, the firmware of the gateway does not support it", command, parameter.c_str());
+    return false;
+  }
+
+  if (_command_queue.size() == MAX_COMMAND_QUEUE_LENGTH) {
+    ESP_LOGE("otgw", "Failed to send %s=%s because the queue is full", command, parameter.c_str());
+    _metrics.dropped_commands++;
+    return false;
+  }
+
+  _command_queue.push_back(std::string(command) + "=" + parameter + "\r\n");
+  update_queue_high_water_mark();
+  return true;
+}
+
+void OpenthermGatewayCore::requeue_command(std::string const &command) {
+  if (_command_queue.size() == MAX_COMMAND_QUEUE_LENGTH) {
+    _metrics.dropped_commands++;
+    return;
+  }
+
+  _command_queue.push_back(command);
+  update_queue_high_water_mark();
+}
+
+void OpenthermGatewayCore::update_queue_high_water_mark() {
+  if (_command_queue.size() > _metrics.command_queue_high_water_mark) {
+    _metrics.command_queue_high_water_mark = _command_queue.size();
+  }
+}
+
+void OpenthermGatewayCore::read_available() {
+  OTGW_PROFILE(READ_AVAILABLE);
+  uint64_t start = now_ms();
+  uint16_t bytes = 0;
+  uint16_t lines = 0;
+  while (serial_available()) {
+    if (_max_bytes_per_loop != 0 && bytes == _max_bytes_per_loop) {
+      break;
+    }
+
+    int c = serial_read();
+    if (c == -1) {  // Nothing received
+      return;
+    }
+    bytes++;
+
+    if (c == '\r') {  // Can be ignored
+      continue;
+    }
+
+    if (c == '\n') {  // End of the line
+      if (_discarding_line) {
+        _discarding_line = false;
+        continue;
+      }
+      handle_line(_receive_buffer);
+      parse_line(_receive_buffer);
+      _receive_buffer.clear();
+
+      lines++;
+      if (
+        (_max_lines_per_loop != 0 && lines == _max_lines_per_loop) ||
+        (_max_time_per_loop != 0 && now_ms() - start >= _max_time_per_loop)
+      ) {
+        break;
+      }
+      continue;
+    }
+
+    if (_discarding_line) {
+      continue;
+    }
+    if (_receive_buffer.size() == MAX_BUFFER_SIZE) {
+      // Buffer full, the rest of the line is dropped up to its end rather than parsed as a line of its own
+      ESP_LOGE("otgw", "Received line is longer than %u characters", static_cast<unsigned>(MAX_BUFFER_SIZE));
+      _metrics.parse_errors++;
+      _receive_buffer.clear();
+      _discarding_line = true;
+      continue;
+    }
+
+    if (_receive_buffer.empty()) {
+      _time_line_arrived_after = _time_receive_idle;
+    }
+    _receive_buffer += static_cast<char>(c);
+  }
+
+  // Whatever is left will be handled next loop
+  int backlog = serial_available();
+  if (backlog == 0) {
+    _time_receive_idle = now_ms();
+  } else if (backlog > _metrics.receive_backlog) {
+    _metrics.receive_backlog = backlog;
+  }
+}
+
+void OpenthermGatewayCore::parse_command_response(std::string const &line) {
+  if (_trace.enabled()) {
+    _trace.record_command(now_ms(), '<', line);
+  }
+
+  if (!_send_command) {
+    ESP_LOGE("otgw", "Received unexpected reply (%s).", line.c_str());
+    return;
+  }
+
+  std::string command_code = line.substr(0, 2);
+
+  if (command_code == "OE") {
+    _metrics.overrun_errors++;
+    requeue_command(*_send_command);
+    _send_command.reset();
+    return;
+  }
+
+  if (command_code == "NS" && _send_command->compare(0, 3, "AA=") == 0) {
+    alternative_rejected(std::atoi(_send_command->c_str() + 3));
+  }
+
+  if (command_code == "NG") {
+    _metrics.unknown_command_errors++;
+    uint8_t capability = capability_of(_send_command->c_str());
+    if (capability != 0) {
+      ESP_LOGW("otgw", "The gateway does not know %.2s, not using it anymore", _send_command->c_str());
+      _capabilities &= ~capability;
+    }
+  } else if (command_code == "SE") {
+    _metrics.syntax_errors++;
+  }
+
+  if (is_error(command_code)) {
+    _send_command.reset();
+    return;
+  }
+
+  if (command_code != _send_command->substr(0, 2)) {
+    ESP_LOGE("otgw", "Received reply (%s) that does not match command (%s).", line.c_str(), _send_command->c_str());
+    return;
+  }
+
+  _lines_since_command = 0;
+
+  if (command_code == "PR") {
+    // Replies look like "PR: A=<value>"
+    if (line.size() < 7 || line[5] != '=') {
+      ESP_LOGE("otgw", "Received malformed reply (%s) to command (%s).", line.c_str(), _send_command->c_str());
+      _send_command.reset();
+      return;
+    }
+
+    char print_report_code = line[4];
+    if (_send_command->at(3) != print_report_code) {
+      ESP_LOGE("otgw", "Received reply (%s) that does not match command (%s).", line.c_str(), _send_command->c_str());
+      return;
+    }
+
+    if (print_report_code == 'M') {
+      // G for gateway mode, M for monitor mode
+      _gateway_mode = line[6] != 'M';
+    } else {
+      if (print_report_code == 'A') {
+        detect_capabilities(line.substr(6));
+      }
+      handle_print_report(print_report_code, line.substr(6));
+    }
+  } else {
+    handle_command_reply(command_code, line);
+  }
+  _send_command.reset();
+}
+
+void OpenthermGatewayCore::record_response_times(OpenthermGatewayCore::Transaction const &transaction) {
+  // Leave out lines that were not timestamped precisely, e.g. because they waited in the UART
+  auto precise = [&transaction](Transaction::Step step) {
+    auto const &message = transaction.data[step];
+    return message && message->uncertainty <= RESPONSE_TIME_RESOLUTION ? message : std::nullopt;
+  };
+  auto const thermostat_request = precise(Transaction::TH_REQUEST);
+  auto const gateway_request = precise(Transaction::GA_REQUEST);
+  auto const boiler_response = precise(Transaction::CH_RESPONSE);
+  auto const gateway_response = precise(Transaction::GA_RESPONSE);
+
+  // Time the gateway spent altering messages
+  if (thermostat_request && gateway_request) {
+    _metrics.gateway_delay_total += gateway_request->time - thermostat_request->time;
+    _metrics.gateway_delays++;
+  }
+  if (boiler_response && gateway_response) {
+    _metrics.gateway_delay_total += gateway_response->time - boiler_response->time;
+    _metrics.gateway_delays++;
+  }
+
+  // The boiler answers the request of the gateway when it changed that of the thermostat
+  auto const &boiler_request = transaction.data[Transaction::GA_REQUEST] ? gateway_request : thermostat_request;
+  if (!boiler_request || !boiler_response) {
+    return;
+  }
+
+  uint32_t response_time = boiler_response->time - boiler_request->time;
+  if (response_time > UINT16_MAX) {
+    return;
+  }
+
+  _metrics.boiler_response_time_total += response_time;
+  _metrics.boiler_response_time_max = std::max<uint16_t>(_metrics.boiler_response_time_max, response_time);
+  _metrics.boiler_responses++;
+
+  auto it = _data_types.find(transaction.slave_data_type);
+  if (it == _data_types.end() || !it->second.statistics) {
+    return;
+  }
+
+  auto &statistics = *it->second.statistics;
+  statistics.max_response_time = std::max<uint16_t>(statistics.max_response_time, response_time);
+
+  auto const &buckets = DataTypeInfo::Statistics::RESPONSE_TIME_BUCKETS;
+  uint8_t bucket = std::upper_bound(buckets.begin(), buckets.end(), response_time) - buckets.begin();
+  auto &histogram = statistics.response_time_histogram;
+  if (histogram[bucket] == UINT16_MAX) {
+    for (auto &count : histogram) {
+      count /= 2;
+    }
+  }
+  histogram[bucket]++;
+}
+
+void OpenthermGatewayCore::handle_transaction(OpenthermGatewayCore::Transaction const &transaction) {
+  OTGW_PROFILE(PUBLISH);
+#if OTGW_FRAME_LOG_LEVEL != 0
+  if (_frame_log_level != 0) {
+    OTGW_LOG_FRAME("Received %d,%d transaction:", transaction.master_data_type, transaction.slave_data_type);
+    for (uint8_t step = 0; step != 4; ++step) {
+      auto message = transaction.data[step];
+      if (message) {
+        OTGW_LOG_FRAME("  %c, %s: %d", Transaction::STEP[step], Transaction::MESSAGE_TYPE[message->message_type], message->data);
+      }
+    }
+  }
+#endif
+
+  record_response_times(transaction);
+
+  bool reusable_master_slot = false;
+  if (
+    _reuse_master_slots && transaction.data[Transaction::TH_REQUEST] &&
+    transaction.data[Transaction::TH_REQUEST]->message_type == Transaction::WRITE_DATA && (
+      transaction.master_data_type == RoomSetpoint::ID ||
+      transaction.master_data_type == RoomSetpoint2::ID ||
+      transaction.master_data_type == RoomTemperature::ID ||
+      transaction.master_data_type == RoomTemperatureCH2::ID ||
+      transaction.master_data_type == MasterOpenThermVersion::ID ||
+      transaction.master_data_type == MasterProductVersion::ID
+    )
+  ) {
+    reusable_master_slot = true;
+  }
+
+  if (transaction.master_data_type != transaction.slave_data_type) {
+    // In this case we are really dealing with two transactions so we split them up
+    if (transaction.slave_data_type == SlaveOpenThermVersion::ID) {
+      _ready_for_requests = true;
+    }
+
+    // Alternatives we did not add disrupt the algorithm determining when to send priority
+    // messages
+    bool alternative = is_alternative(transaction.slave_data_type);
+    if (!alternative) {
+      queue_command("DA", std::to_string(transaction.slave_data_type));
+    }
+
+    if (!reusable_master_slot) {
+      auto const &data_type_info = _data_types[transaction.master_data_type];
+      if (data_type_info.interest && data_type_info.supported) {
+        // We are interested but apparently it is marked as unknown
+        queue_command("KI", std::to_string(transaction.master_data_type));
+      }
+    }
+
+    // This was an overriden message. If it was because of a "PM" we can mark the request as done.
+    // If something else caused it it is still a good idea to mark it as done, as we might otherwise
+    // cause the system to wait on a PM response that never comes. Our own alternatives only fill
+    // the slots the PM did not take.
+    bool requested = _data_type_request && _data_type_request->data_type == transaction.slave_data_type;
+    if (requested && _data_type_request->priority_message) {
+      _metrics.priority_requests_fulfilled++;
+    }
+    if (requested || !alternative) {
+      _data_type_request.reset();
+    }
+
+    auto data = transaction.data;
+    data[Transaction::GA_REQUEST].reset();
+    data[Transaction::CH_RESPONSE].reset();
+    handle_transaction_messages(transaction.master_data_type, data);
+
+    data = transaction.data;
+    data[Transaction::TH_REQUEST].reset();
+    data[Transaction::GA_RESPONSE].reset();
+    handle_transaction_messages(transaction.slave_data_type, data, true);
+  } else {
+    uint8_t data_type = transaction.master_data_type;
+
+    if (reusable_master_slot) {
+      queue_command("UI", std::to_string(data_type));
+    }
+
+    handle_transaction_messages(data_type, transaction.data);
+  }
+}
+
+void OpenthermGatewayCore::update_statistics(
+  DataTypeInfo::Statistics &statistics, bool supported, bool requested_by_gateway, uint16_t value
+) {
+  if (!supported) {
+    statistics.failures++;
+    return;
+  }
+
+  uint64_t now = now_ms();
+  if (statistics.received != 0 && now >= statistics.time_last_received) {
+    uint64_t elapsed = now - statistics.time_last_received;
+    uint32_t interval = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    statistics.min_interval = std::min(statistics.min_interval, interval);
+    statistics.max_interval = std::max(statistics.max_interval, interval);
+    statistics.total_interval += interval;
+  }
+
+  statistics.received++;
+  if (requested_by_gateway) {
+    statistics.requested_by_gateway++;
+  }
+  statistics.time_last_received = now;
+  statistics.last_value = value;
+}
+
+void OpenthermGatewayCore::handle_transaction_messages(
+  uint8_t data_type, OpenthermGatewayCore::Transaction::Messages data, bool requested_by_gateway
+) {
+  std::optional<bool> read_transaction;
+  bool supported = true;
+  for (uint8_t step = 0; step != 4; ++step) {
+    auto &message = data[step];
+    if (!message) {
+      continue;
+    }
+
+    bool step_request = step <= Transaction::GA_REQUEST;
+    bool message_type_request = message->message_type <= Transaction::RESERVED;
+    if (step_request != message_type_request) {
+      ESP_LOGE("otgw", "Received line message type (%d) and transaction step (%d) does not match", message->message_type, step);
+      return;
+    }
+
+    std::optional<bool> read_message;
+    switch (message->message_type) {
+      case Transaction::READ_DATA:
+        read_message = true;
+        break;
+      case Transaction::WRITE_DATA:
+        read_message = false;
+        break;
+      case Transaction::INVALID_DATA:
+        // This means that this message is required to be sent but not valid
+        // in this particular situation
+        ESP_LOGW("otgw", "MSG %d: invalid data", data_type);
+        return;
+      case Transaction::RESERVED:
+        return;
+
+      case Transaction::READ_ACK:
+        read_message = true;
+        break;
+      case Transaction::WRITE_ACK:
+        read_message = false;
+        break;
+      case Transaction::DATA_INVALID:
+        ESP_LOGW("otgw", "MSG %d: data invalid", data_type);
+        supported = false;
+        break;
+      case Transaction::UNKNOWN_DATAID:
+        if (step != Transaction::GA_RESPONSE) {
+          // This just means the gateway has overriden the request, not really an error
+          ESP_LOGW("otgw", "MSG %d: unknown dataid", data_type);
+          supported = false;
+        }
+        break;
+      default:
+        ESP_LOGE("otgw", "Received unknown message type %d", message->message_type);
+        return;
+    }
+
+    if (read_message) {
+      if (!read_transaction) {
+        read_transaction = read_message;
+      } else if (*read_message != *read_transaction) {
+        ESP_LOGE("otgw",
+          "Received %s transaction contains conflicting message type %d",
+          *read_transaction ? "READ" : "WRITE", message->message_type
+        );
+      }
+    }
+  }
+
+  if (!read_transaction) {
+    ESP_LOGE("otgw", "Couldn't deduce message READ or write from transaction %d", data_type);
+    return;
+  }
+
+  // Count the number of consecutive failures, this will then be used to determine if it should be
+  // reported as unknown
+  DataTypeInfo& info = _data_types[data_type];
+  if (!supported) {
+    info.consecutive_failures = std::min(info.consecutive_failures + 1, 10);
+  } else {
+    info.consecutive_failures = 0;
+    info.supported = true;
+  }
+
+  if (info.readable_info) {
+    info.readable_info->time_last_received = seconds();
+  }
+
+  if (_statistics_enabled) {
+    if (!info.statistics) {
+      info.statistics = std::make_unique<DataTypeInfo::Statistics>();
+    }
+
+    auto value = data[Transaction::CH_RESPONSE] ? data[Transaction::CH_RESPONSE] : data[Transaction::TH_REQUEST];
+    update_statistics(*info.statistics, supported, requested_by_gateway, value ? value->data : 0);
+  }
+  if (_data_type_request && _data_type_request->data_type == data_type) {
+    if (_data_type_request->priority_message) {
+      _metrics.priority_requests_fulfilled++;
+    }
+    _data_type_request.reset();
+  }
+
+  // Some data types are commands, the heater will send the value back to the thermostat,
+  // so we can get the relevant data from the heater response
+  bool treat_as_read_transaction = (
+    *read_transaction ||
+    data_type == ControlSetpoint::ID ||
+    data_type == ControlSetpoint2::ID ||
+    data_type == MaxRelativeModulationLevel::ID ||
+    data_type == DHWSetpoint::ID ||
+    data_type == MaxCHWaterSetpoint::ID
+  );
+
+  if (data[Transaction::CH_RESPONSE]) {
+    if ((
+      !info.interest &&
+      // Without these the heating might not function
+      data_type != Status::ID &&
+      data_type != SlaveConfiguration::ID &&
+      data_type != ControlSetpoint::ID &&
+      data_type != ControlSetpoint2::ID &&
+      data_type != BoilerFlowWaterTemperature::ID &&
+      data_type != FlowTemperatureCH2::ID &&
+      data_type != MaxRelativeModulationLevel::ID &&
+      data_type != RelativeModulationLevel::ID &&
+      data_type != RemoteRequest::ID &&
+      data_type != CoolingControl::ID &&
+      (data_type != RemoteOverrideRoomSetpoint::ID || _ignore_heater_overrides) &&
+      (data_type != RemoteOverrideRoomSetpoint2::ID || _ignore_heater_overrides)
+    ) || info.consecutive_failures >= 3) {
+      // Tell the gateway that we are not interested in this data type. Older firmware can't be
+      // told, and would get these commands for every message of this data type.
+      if (has_capability(UNKNOWN_IDS)) {
+        std::string data_type_as_str = std::to_string(data_type);
+        queue_command("UI", data_type_as_str);
+        queue_command("DA", data_type_as_str);
+      }
+      info.supported = false;
+    }
+  }
+
+  if (treat_as_read_transaction) {
+    if (!supported) {
+      return;
+    }
+
+    auto data_value = data[Transaction::CH_RESPONSE];
+    if (data_value) {
+      handle_slave_response(data_type, data_value->data);
+    }
+    data_value = data[Transaction::GA_RESPONSE];
+    if (data_value) {
+      handle_gateway_response(data_type, data_value->data);
+    }
+  } else {
+    auto data_value = data[Transaction::TH_REQUEST];
+    if (data_value) {
+      handle_master_request(data_type, data_value->data);
+    }
+  }
+}
+
+void OpenthermGatewayCore::parse_line(std::string const &line) {
+  OTGW_PROFILE(PARSE_LINE);
+  OTGW_LOG_FRAME("Received line %s", line.c_str());
+  // Errors are reported as just the error code
+  if ((line.size() >= 3 && line[2] == ':') || (line.size() == 2 && is_error_code(line))) {
+    parse_command_response(line);
+    return;
+  }
+
+  count_line_since_command();
+
+  // Printed after every reset of the PIC, e.g. "OpenTherm Gateway 5.4"
+  if (line.rfind(GATEWAY_BANNER, 0) == 0) {
+    gateway_reset(line);
+    return;
+  }
+
+  if (_summary_interval != 0 && line.find(',') != std::string::npos) {
+    parse_summary(line);
+    return;
+  }
+
+  if (line.size() != 9) {
+    ESP_LOGE("otgw", "Received line (%s) is not 9 characters", line.c_str());
+    _metrics.parse_errors++;
+    return;
+  }
+
+  if (!std::all_of(line.begin() + 1, line.end(), [](unsigned char c) { return std::isxdigit(c); })) {
+    ESP_LOGE("otgw", "Received line (%s) is not a hexadecimal message", line.c_str());
+    _metrics.parse_errors++;
+    return;
+  }
+
+  auto transaction_step = Transaction::step_from_char(line[0]);
+  if (!transaction_step) {
+    ESP_LOGE("otgw", "Received line (%s) does not start with B, T, R, or A", line.c_str());
+    _metrics.parse_errors++;
+    return;
+  }
+
+  handle_frame(*transaction_step, strtoul(line.c_str() + 1, nullptr, 16), now_ms(), _time_line_arrived_after);
+}
+
+void OpenthermGatewayCore::count_line_since_command() {
+  if (_send_command) {
+    if (_lines_since_command > 3) {
+      ESP_LOGE("otgw", "Did not receive a reply to command (%s).", _send_command->c_str());
+      requeue_command(*_send_command);
+      _send_command.reset();
+    } else {
+      _lines_since_command++;
+    }
+  }
+}
+
+void OpenthermGatewayCore::handle_frame(
+  Transaction::Step transaction_step, uint32_t message, uint64_t now, uint64_t arrived_after
+) {
+  uint8_t message_type = (message >> 28) & 0b0111;
+  uint8_t data_type = (message >> 16) & 0xFF;
+  uint16_t data = message & 0xFFFF;
+  OTGW_LOG_FRAME("  Data type %d: %s", data_type, Transaction::MESSAGE_TYPE[message_type]);
+
+  _metrics.frames[transaction_step]++;
+  // The frame can make data types available to request again
+  _requests_exhausted = false;
+  if (_trace.enabled()) {
+    _trace.record(now, message, Transaction::STEP[transaction_step]);
+  }
+
+  // Check if this is the start of a new transaction
+  if (_current_transaction) {
+    if (
+      transaction_step <= _last_transaction_step ||
+      // The lines of a transaction follow each other closely, a gap means lines were lost. Only a
+      // line that arrived after the gap shows one, lines can be handled late when they waited in the
+      // UART.
+      (arrived_after > _time_last_line && arrived_after - _time_last_line > TRANSACTION_TIMEOUT)
+    ) {
+      finalize_transaction();
+    } else if (
+      transaction_step == Transaction::CH_RESPONSE &&
+      _current_transaction->slave_data_type != data_type
+    ) {
+      ESP_LOGE("otgw", "Type of frame (%c%08" PRIX32 ") does not match that of transaction (%d)",
+               Transaction::STEP[transaction_step], message, _current_transaction->slave_data_type);
+      _metrics.transaction_mismatches++;
+      // Lines were lost, handle what we have and continue with this line as a new transaction
+      finalize_transaction();
+    } else if (
+      transaction_step == Transaction::GA_RESPONSE &&
+      _current_transaction->master_data_type != data_type
+    ) {
+      ESP_LOGE("otgw", "Type of frame (%c%08" PRIX32 ") does not match that of transaction (%d)",
+               Transaction::STEP[transaction_step], message, _current_transaction->master_data_type);
+      _metrics.transaction_mismatches++;
+      finalize_transaction();
+    }
+  }
+  _time_last_line = now;
+
+  // If this is a new transaction
+  if (!_current_transaction) {
+    if (transaction_step == Transaction::GA_RESPONSE) {
+      // Without the request it is unclear what the gateway responded to
+      _metrics.dropped_lines++;
+      return;
+    }
+
+    // If the request was lost, the boiler response still tells us the data type
+    _current_transaction = Transaction{};
+    _current_transaction->slave_data_type = data_type;
+    _current_transaction->master_data_type = data_type;
+  }
+
+  // The gateway can change the request to slot in for an unknown dataid
+  if (transaction_step == Transaction::GA_REQUEST) {
+    _current_transaction->slave_data_type = data_type;
+  }
+
+  uint64_t uncertainty = now > arrived_after ? now - arrived_after : 0;
+  _current_transaction->data[transaction_step] = Transaction::Message{
+    Transaction::MessageType{message_type}, data, static_cast<uint32_t>(now),
+    static_cast<uint16_t>(std::min<uint64_t>(uncertainty, UINT16_MAX))
+  };
+  _last_transaction_step = transaction_step;
+
+  // Nothing comes after the gateway response, so there is no need to wait for the next transaction.
+  // In monitor mode the gateway never responds itself.
+  if (
+    transaction_step == Transaction::GA_RESPONSE ||
+    (transaction_step == Transaction::CH_RESPONSE && !_gateway_mode)
+  ) {
+    finalize_transaction();
+  }
+}
+
+uint32_t OpenthermGatewayCore::transaction_timeout() const {
+  // A gateway response is sent right after the boiler response, if there is one at all
+  if (_last_transaction_step == Transaction::CH_RESPONSE) {
+    return GATEWAY_RESPONSE_TIMEOUT;
+  }
+  return TRANSACTION_TIMEOUT;
+}
+
+void OpenthermGatewayCore::finalize_transaction() {
+  if (!_current_transaction) {
+    return;
+  }
+
+  // The thermostat sends every request and the boiler answers it, unless the gateway answers in its
+  // place. A request the gateway changed (R) always gets a gateway response (A).
+  auto const &data = _current_transaction->data;
+  if (!data[Transaction::TH_REQUEST]) {
+    _metrics.dropped_lines++;
+  }
+  if (!data[Transaction::CH_RESPONSE] && (data[Transaction::GA_REQUEST] || !data[Transaction::GA_RESPONSE])) {
+    _metrics.dropped_lines++;
+  }
+  if (_gateway_mode && data[Transaction::GA_REQUEST] && !data[Transaction::GA_RESPONSE]) {
+    _metrics.dropped_lines++;
+  }
+
+  handle_transaction(*_current_transaction);
+  _current_transaction.reset();
+}
+
+void OpenthermGatewayCore::begin() {
+  // Get gateway info
+  queue_command("PR", "A");
+  queue_command("PR", "B");
+  queue_command("PR", "Q");
+  queue_command("PR", "M");
+
+  if (_summary_interval != 0) {
+    // There are no messages to detect the end of the initialization with
+    return;
+  }
+
+  // Trigger slave opentherm version requests. We do this to find out when the initialization of
+  // the gateway is done
+  queue_command("KI", SlaveOpenThermVersion::as_str());
+  queue_command("AA", SlaveOpenThermVersion::as_str());
+}
+
+void OpenthermGatewayCore::send_next_command() {
+  _send_command = _command_queue[0];
+  _command_queue.erase(_command_queue.begin());
+
+  // Queued before the reply to PR=A showed that the firmware does not have it, e.g. KI by begin()
+  uint8_t capability = capability_of(_send_command->c_str());
+  if (capability != 0 && !(_capabilities & capability)) {
+    ESP_LOGD("otgw", "Skipped %.2s, the firmware of the gateway does not support it", _send_command->c_str());
+    _send_command.reset();
+    return;
+  }
+
+  ESP_LOGD("otgw", "> %s", _send_command->c_str());
+  serial_write(*_send_command);
+  _metrics.command_bytes += _send_command->size();
+  if (_trace.enabled()) {
+    _trace.record_command(now_ms(), '>', *_send_command);
+  }
+}
+
+void OpenthermGatewayCore::schedule_data_type_request() {
+  uint32_t current_time = seconds();
+
+  if (_data_type_request) {
+    if (
+      _data_type_request->time_of_request + DATA_TYPE_REQUEST_TIMEOUT < current_time ||
+      _data_type_request->time_of_request > current_time // clock overflow
+    ) {
+      ESP_LOGD("otgw", "Did not receive data after PM=%d command", _data_type_request->data_type);
+      if (_data_type_request->priority_message) {
+        _metrics.priority_requests_timed_out++;
+      }
+      _data_type_request.reset();
+    }
+  } else if (_ready_for_requests) {
+    std::optional<DataTypeRequest> most_outdated_data_type;
+    for (auto &item : _data_types) {
+      if (!item.second.interest || !item.second.supported || !item.second.readable_info) {
+        continue;
+      }
+
+      auto time_last_received = item.second.readable_info->time_last_received;
+      if (!time_last_received) {
+        most_outdated_data_type = DataTypeRequest{item.first, current_time};
+        break;
+      }
+
+      uint32_t interval = item.second.readable_info->interval * 60;
+      if (is_alternative(item.first)) {
+        // The gateway requests it by itself, only step in when it is late
+        interval *= 2;
+      }
+      auto time_of_next_request = *time_last_received + interval;
+      if (!most_outdated_data_type || time_of_next_request < most_outdated_data_type->time_of_request) {
+        most_outdated_data_type = DataTypeRequest{item.first, time_of_next_request};
+      }
+    }
+
+    // Without alternatives PM is the only way to get data, so the slots are used continuously
+    if (!has_capability(PRIORITY_MESSAGE)) {
+      most_outdated_data_type.reset();
+    }
+    if (most_outdated_data_type && (!alternatives_enabled() || most_outdated_data_type->time_of_request <= current_time)) {
+      uint8_t data_type = most_outdated_data_type->data_type;
+
+      _data_type_request = DataTypeRequest{data_type, current_time, true};
+      queue_command("PM", std::to_string(data_type));
+      _metrics.priority_requests_issued++;
+    } else {
+      _requests_exhausted = true;
+    }
+  }
+}
+
+bool OpenthermGatewayCore::is_alternative(uint8_t data_type) const {
+  return std::find(_alternatives.begin(), _alternatives.end(), data_type) != _alternatives.end();
+}
+
+bool OpenthermGatewayCore::wants_alternative(DataTypeInfo const &info) const {
+  return (
+    info.interest && info.supported && info.readable_info &&
+    info.readable_info->interval <= MAX_ALTERNATIVE_INTERVAL
+  );
+}
+
+void OpenthermGatewayCore::update_alternatives() {
+  // Unsupported data types are removed from the table of the gateway when that is detected
+  _alternatives.erase(std::remove_if(_alternatives.begin(), _alternatives.end(), [this](uint8_t data_type) {
+    return !wants_alternative(_data_types[data_type]);
+  }), _alternatives.end());
+
+  uint32_t current_time = seconds();
+  if (_time_alternatives_rejected) {
+    if (current_time - *_time_alternatives_rejected >= ALTERNATIVES_RETRY_INTERVAL) {
+      ESP_LOGD("otgw", "Trying to use the whole alternatives table again");
+      _alternatives_capacity = MAX_ALTERNATIVES;
+      _time_alternatives_rejected.reset();
+    } else if (_alternatives.empty()) {
+      // Not even one fitted, every AA would be rejected until entries are removed
+      return;
+    }
+  }
+
+  // Add the data type that has been waiting the longest. Data types that arrive in time, e.g.
+  // because the thermostat requests them, don't need to be in the table.
+  std::optional<uint8_t> missing;
+  uint32_t missing_time_last_received = 0;
+  for (auto const &item : _data_types) {
+    if (!wants_alternative(item.second) || is_alternative(item.first)) {
+      continue;
+    }
+
+    auto const &readable_info = *item.second.readable_info;
+    uint32_t time_last_received = readable_info.time_last_received.value_or(0);
+    if (readable_info.time_last_received && time_last_received + readable_info.interval * 60 > current_time) {
+      continue;
+    }
+
+    if (!missing || time_last_received < missing_time_last_received) {
+      missing = item.first;
+      missing_time_last_received = time_last_received;
+    }
+  }
+
+  if (!missing) {
+    return;
+  }
+
+  if (_alternatives.size() >= _alternatives_capacity) {
+    if (current_time - _time_alternatives_rotated < ALTERNATIVES_ROTATION_INTERVAL) {
+      return;
+    }
+
+    // Make room by removing the one that was received most recently
+    auto freshest = std::max_element(_alternatives.begin(), _alternatives.end(), [this](uint8_t a, uint8_t b) {
+      return (
+        _data_types[a].readable_info->time_last_received.value_or(0) <
+        _data_types[b].readable_info->time_last_received.value_or(0)
+      );
+    });
+    if (!queue_command("DA", std::to_string(*freshest))) {
+      return;
+    }
+    _alternatives.erase(freshest);
+    _time_alternatives_rotated = current_time;
+  }
+
+  if (queue_command("AA", std::to_string(*missing))) {
+    _alternatives.push_back(*missing);
+  }
+}
+
+void OpenthermGatewayCore::alternative_rejected(uint8_t data_type) {
+  auto it = std::find(_alternatives.begin(), _alternatives.end(), data_type);
+  if (it == _alternatives.end()) {
+    return;
+  }
+
+  _alternatives.erase(it);
+  // At least one, so the table is still rotated when it is shared
+  _alternatives_capacity = std::max<size_t>(_alternatives.size(), 1);
+  _time_alternatives_rejected = seconds();
+  ESP_LOGI("otgw", "The alternatives table of the gateway has room for %u of our data types", _alternatives_capacity);
+}
+
+void OpenthermGatewayCore::gateway_reset(std::string const &banner) {
+  ESP_LOGI("otgw", "The gateway was reset (%s)", banner.c_str());
+  // The firmware may have been replaced
+  detect_capabilities(banner);
+  // The alternatives table and the unknown data types are kept in EEPROM, so _alternatives still
+  // matches the table and stays as it is
+  handle_gateway_reset();
+}
+
+void OpenthermGatewayCore::request_summary() {
+  if (!has_capability(SUMMARY)) {
+    ESP_LOGW("otgw", "The firmware of the gateway has no summary report, following the messages instead");
+    _summary_interval = 0;
+    queue_command("KI", SlaveOpenThermVersion::as_str());
+    queue_command("AA", SlaveOpenThermVersion::as_str());
+    return;
+  }
+
+  uint64_t now = now_ms();
+  if (_time_summary_requested && now - *_time_summary_requested < _summary_interval) {
+    return;
+  }
+
+  if (queue_command("PS", "1")) {
+    _time_summary_requested = now;
+  }
+}
+
+void OpenthermGatewayCore::detect_capabilities(std::string const &version) {
+  // Looks like "OpenTherm Gateway 5.4" or "OpenTherm Gateway 4.2.5"
+  size_t start = version.find_last_of(' ');
+  char const *position = version.c_str() + (start == std::string::npos ? 0 : start + 1);
+  char *end;
+  unsigned long major = strtoul(position, &end, 10);
+  if (end == position || *end != '.') {
+    ESP_LOGW("otgw", "Could not parse the firmware version (%s)", version.c_str());
+    return;
+  }
+  unsigned long minor = strtoul(end + 1, nullptr, 10);
+
+  auto known = std::find_if(KNOWN_FIRMWARES.rbegin(), KNOWN_FIRMWARES.rend(), [&](FirmwareCapabilities const &firmware) {
+    return major > firmware.major || (major == firmware.major && minor >= firmware.minor);
+  });
+  if (known == KNOWN_FIRMWARES.rend()) {
+    ESP_LOGW("otgw", "Firmware %lu.%lu is older than any known version", major, minor);
+    _capabilities = 0;
+    return;
+  }
+
+  _capabilities = known->capabilities;
+  ESP_LOGI(
+    "otgw", "Firmware %lu.%lu:%s%s%s%s%s", major, minor,
+    has_capability(PRIORITY_MESSAGE) ? " PM" : "",
+    has_capability(UNKNOWN_IDS) ? " KI/UI" : "",
+    has_capability(ALTERNATIVES) ? " AA/DA" : "",
+    has_capability(SUMMARY) ? " PS" : "",
+    has_capability(SECOND_CIRCUIT) ? " C2/H2" : ""
+  );
+}
+
+uint8_t OpenthermGatewayCore::capability_of(char const *command) {
+  auto is = [command](char const *code) { return command[0] == code[0] && command[1] == code[1]; };
+  if (is("PM"))
+    return PRIORITY_MESSAGE;
+  if (is("KI") || is("UI"))
+    return UNKNOWN_IDS;
+  if (is("AA") || is("DA"))
+    return ALTERNATIVES;
+  if (is("PS"))
+    return SUMMARY;
+  if (is("C2") || is("H2"))
+    return SECOND_CIRCUIT;
+  return 0;
+}
+
+void OpenthermGatewayCore::parse_summary(std::string const &line) {
+  // Only hand out values once the whole line turned out to be valid
+  std::array<uint16_t, SUMMARY_FIELDS.size()> values;
+  char const *position = line.c_str();
+  for (size_t i = 0; i != SUMMARY_FIELDS.size(); ++i) {
+    char *end = nullptr;
+    switch (SUMMARY_FIELDS[i].format) {
+      case SummaryFormat::FLAGS:
+      case SummaryFormat::BYTES: {
+        int base = SUMMARY_FIELDS[i].format == SummaryFormat::FLAGS ? 2 : 10;
+        long high = strtol(position, &end, base);
+        if (end == position || *end != '/') {
+          end = nullptr;
+          break;
+        }
+        char const *low_position = end + 1;
+        long low = strtol(low_position, &end, base);
+        if (end == low_position) {
+          end = nullptr;
+          break;
+        }
+        values[i] = (static_cast<uint8_t>(high) << 8) | static_cast<uint8_t>(low);
+        break;
+      }
+      case SummaryFormat::F88: {
+        float value = strtof(position, &end);
+        values[i] = static_cast<uint16_t>(static_cast<int16_t>(lroundf(value * 256.0f)));
+        break;
+      }
+      case SummaryFormat::U16:
+        values[i] = static_cast<uint16_t>(strtoul(position, &end, 10));
+        break;
+    }
+
+    char separator = i + 1 == SUMMARY_FIELDS.size() ? '\0' : ',';
+    if (end == nullptr || end == position || *end != separator) {
+      ESP_LOGE("otgw", "Received summary (%s) does not match the layout at field %u", line.c_str(), static_cast<unsigned>(i + 1));
+      _metrics.parse_errors++;
+      return;
+    }
+    position = end + 1;
+  }
+
+  for (size_t i = 0; i != SUMMARY_FIELDS.size(); ++i) {
+    if (SUMMARY_FIELDS[i].master) {
+      handle_master_request(SUMMARY_FIELDS[i].data_type, values[i]);
+    } else {
+      handle_slave_response(SUMMARY_FIELDS[i].data_type, values[i]);
+    }
+  }
+}
+
+void OpenthermGatewayCore::process() {
+  uint64_t now = now_ms();
+  if (now < next_deadline() && !serial_available()) {
+    _time_receive_idle = now;
+    return;
+  }
+
+  if (!_send_command && !_command_queue.empty()) {
+    send_next_command();
+  } else if (!_send_command) { // Means queue is empty
+    if (alternatives_enabled() && _ready_for_requests) {
+      update_alternatives();
+    }
+    // We do this here to avoid spamming the queue
+    handle_idle();
+    if (_summary_interval != 0) {
+      request_summary();
+    } else {
+      schedule_data_type_request();
+    }
+  }
+
+  read_available();
+
+  // Don't hold on to a transaction when nothing more is coming. Anything still in the UART buffer
+  // might belong to it, so wait for that to be handled first
+  if (_current_transaction && now_ms() - _time_last_line > transaction_timeout() && !serial_available()) {
+    finalize_transaction();
+  }
+
+  update_next_deadline();
+}
+
+uint64_t OpenthermGatewayCore::next_deadline() const {
+  if (!_send_command && !_command_queue.empty()) {
+    return 0;
+  }
+  return _next_deadline;
+}
+
+void OpenthermGatewayCore::update_next_deadline() {
+  uint64_t deadline = UINT64_MAX;
+  if (_current_transaction) {
+    deadline = _time_last_line + transaction_timeout() + 1;
+  }
+
+  // While a command is pending everything waits for its reply, or for enough lines to give up on it
+  if (!_send_command) {
+    deadline = std::min(deadline, idle_deadline());
+
+    if (_summary_interval != 0) {
+      deadline = std::min(deadline, _time_summary_requested ? *_time_summary_requested + _summary_interval : 0);
+    }
+
+    if (_data_type_request) {
+      uint64_t timeout = (_data_type_request->time_of_request + DATA_TYPE_REQUEST_TIMEOUT + 1) * uint64_t{1000};
+      deadline = std::min(deadline, timeout);
+    } else if (_ready_for_requests && !_requests_exhausted) {
+      deadline = 0;
+    }
+  }
+
+  _next_deadline = deadline;
+}
+
+void OpenthermGatewayCore::set_interest(uint8_t data_type, uint16_t interval) {
+  _requests_exhausted = false;
+  auto &data_type_info = _data_types[data_type];
+  data_type_info.interest = true;
+  if (interval != 0) {
+    data_type_info.readable_info = DataTypeInfo::ReadableInfo{interval, std::nullopt};
+  }
+}
+
+void OpenthermGatewayCore::set_receive_idle(uint64_t time) {
+  _time_receive_idle = std::max(_time_receive_idle, time);
+}
+
+void OpenthermGatewayCore::reuse_master_slots(bool reuse_slots) {
+  _reuse_master_slots = reuse_slots;
+}
+
+void OpenthermGatewayCore::ignore_heater_overrides(bool ignore_overrides) {
+  _ignore_heater_overrides = ignore_overrides;
+}
+
+void OpenthermGatewayCore::use_alternatives(bool use_alternatives) {
+  _use_alternatives = use_alternatives;
+}
+
+void OpenthermGatewayCore::set_summary_interval(uint32_t interval) {
+  _summary_interval = interval;
+}
+
+void OpenthermGatewayCore::set_clock(Clock clock) {
+  _clock = clock;
+}
+
+void OpenthermGatewayCore::set_max_bytes_per_loop(uint16_t max_bytes) {
+  _max_bytes_per_loop = max_bytes;
+}
+
+void OpenthermGatewayCore::set_max_lines_per_loop(uint16_t max_lines) {
+  _max_lines_per_loop = max_lines;
+}
+
+void OpenthermGatewayCore::set_max_time_per_loop(uint32_t max_time) {
+  _max_time_per_loop = max_time;
+}
+
+void OpenthermGatewayCore::set_trace_size(uint16_t size) {
+  _trace.set_capacity(size);
+}
+
+void OpenthermGatewayCore::enable_statistics(bool enable) {
+  _statistics_enabled = enable;
+}
+
+void OpenthermGatewayCore::dump_statistics() {
+#ifdef USE_OTGW_PROFILER
+  _profiler.dump();
+#endif
+
+  if (!_statistics_enabled) {
+    ESP_LOGW("otgw", "Statistics are not enabled");
+    return;
+  }
+
+  ESP_LOGI("otgw", "Data type statistics (intervals in seconds):");
+  ESP_LOGI("otgw", " ID  received  by gateway  failures  min int  avg int  max int  last value");
+  for (uint16_t data_type = 0; data_type <= 255; ++data_type) {
+    auto it = _data_types.find(data_type);
+    if (it == _data_types.end() || !it->second.statistics) {
+      continue;
+    }
+
+    auto const &statistics = *it->second.statistics;
+    uint32_t intervals = statistics.received > 1 ? statistics.received - 1 : 0;
+    ESP_LOGI("otgw", "%3d  %8" PRIu32 "  %10" PRIu32 "  %8" PRIu32 "  %7.1f  %7.1f  %7.1f  0x%04X",
+      data_type,
+      statistics.received,
+      statistics.requested_by_gateway,
+      statistics.failures,
+      intervals ? statistics.min_interval / 1000.0f : NAN,
+      intervals ? statistics.total_interval / intervals / 1000.0f : NAN,
+      intervals ? statistics.max_interval / 1000.0f : NAN,
+      statistics.last_value
+    );
+  }
+
+  auto const &buckets = DataTypeInfo::Statistics::RESPONSE_TIME_BUCKETS;
+  ESP_LOGI("otgw", "Boiler response times (ms):");
+  ESP_LOGI("otgw", " ID    max    <%d   <%d   <%d   <%d   <%d   <%d   <%d  >=%d", buckets[0], buckets[1], buckets[2],
+    buckets[3], buckets[4], buckets[5], buckets[6], buckets[6]);
+  for (uint16_t data_type = 0; data_type <= 255; ++data_type) {
+    auto it = _data_types.find(data_type);
+    if (it == _data_types.end() || !it->second.statistics || it->second.statistics->max_response_time == 0) {
+      continue;
+    }
+
+    auto const &statistics = *it->second.statistics;
+    auto const &histogram = statistics.response_time_histogram;
+    ESP_LOGI("otgw", "%3d  %5u  %5u %5u %5u %5u %5u %5u %5u %5u",
+      data_type, statistics.max_response_time, histogram[0], histogram[1], histogram[2], histogram[3], histogram[4],
+      histogram[5], histogram[6], histogram[7]
+    );
+  }
+}
+
+void OpenthermGatewayCore::dump_trace() {
+  if (!_trace.enabled()) {
+    ESP_LOGW("otgw", "The frame trace is not enabled");
+    return;
+  }
+  _trace.dump();
+}
+
+}  // namespace otgw
+}  // namespace esphome
@@ -0,0 +1,392 @@
+#pragma once
+
+#include "data_types.h"
+#include "profiler.h"
+#include "trace.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace esphome {
+namespace otgw {
+
+// The OpenTherm Gateway protocol without any ESPHome dependencies: parsing the lines received from
+// the gateway, assembling them into transactions, the command queue and the PM scheduler.
+//
+// The serial connection and the callbacks for decoded values are provided by a subclass. The
+// ESPHome component (OpenthermGateway) is one, host tools can build this together with
+// data_types.h, trace.h and otgw_log.h by defining OTGW_STANDALONE.
+class OpenthermGatewayCore {
+ public:
+  // All timing goes through this clock, so that it can be replaced by a simulated one
+  using Clock = uint64_t (*)();
+
+  explicit OpenthermGatewayCore(Clock clock) : _clock(clock) {
+    _receive_buffer.reserve(MAX_BUFFER_SIZE);
+    _command_queue.reserve(MAX_COMMAND_QUEUE_LENGTH);
+  }
+  virtual ~OpenthermGatewayCore() = default;
+
+  // Queues the commands that query the gateway and start the initialization
+  void begin();
+
+  // Sends the next command, schedules PM requests and handles the received lines. Call this often,
+  // it returns right away when nothing was received and nothing is due.
+  void process();
+
+  // Time (in ms of the clock) of the next timeout or scheduled work. Until then process() only has
+  // work when data is received.
+  uint64_t next_deadline() const;
+
+  bool queue_command(char const *command, std::string const &parameter);
+
+  // Nothing was received before this time, e.g. because waiting for the serial connection just
+  // returned. Otherwise only the last time process() found the UART empty tells when lines arrived.
+  void set_receive_idle(uint64_t time);
+
+  // Mark a data type as wanted, readable data types are then requested with PM every interval minutes
+  void set_interest(uint8_t data_type, uint16_t interval);
+
+  template<typename DataType>
+  void set_interest() {
+    set_interest(DataType::ID, DataType::INTERVAL);
+  }
+
+  void reuse_master_slots(bool reuse_slots);
+  void ignore_heater_overrides(bool ignore_overrides);
+  void use_alternatives(bool use_alternatives);
+  // Monitoring only: request the summary report (PS=1) every interval ms instead of following the
+  // individual messages. 0 disables summary mode.
+  void set_summary_interval(uint32_t interval);
+  void set_clock(Clock clock);
+  void set_max_bytes_per_loop(uint16_t max_bytes);
+  void set_max_lines_per_loop(uint16_t max_lines);
+  void set_max_time_per_loop(uint32_t max_time);
+  void enable_statistics(bool enable);
+  void set_trace_size(uint16_t size);
+  // 0 for none, 1 to log every line and transaction at DEBUG, 2 at VERBOSE. Only has an effect when
+  // OTGW_FRAME_LOG_LEVEL compiles the logging in.
+  void set_frame_log_level(uint8_t level) { _frame_log_level = level; }
+#ifdef USE_OTGW_PROFILER
+  void enable_profiler(bool enable) { _profiler.enable(enable); }
+#endif
+  void dump_statistics();
+  void dump_trace();
+
+  // Commands that not every firmware version of the gateway supports
+  enum Capability : uint8_t {
+    PRIORITY_MESSAGE = 1 << 0, // PM
+    UNKNOWN_IDS = 1 << 1,      // KI and UI
+    ALTERNATIVES = 1 << 2,     // AA and DA
+    SUMMARY = 1 << 3,          // PS
+    SECOND_CIRCUIT = 1 << 4,   // C2 and H2
+  };
+  bool has_capability(Capability capability) const { return _capabilities & capability; }
+
+  static float parse_float(uint16_t data);
+  static int16_t parse_int16(uint16_t data);
+  static int8_t parse_int8(uint8_t data);
+
+ protected:
+  struct Transaction {
+    enum Step : uint8_t {
+      TH_REQUEST = 0,
+      GA_REQUEST = 1,
+      CH_RESPONSE = 2,
+      GA_RESPONSE = 3,
+    };
+    constexpr static std::array<char, 4> STEP{'T', 'R', 'B', 'A'};
+
+    static std::optional<Step> step_from_char(char step) {
+      switch (step) {
+        case 'T':
+          return TH_REQUEST;
+        case 'R':
+          return GA_REQUEST;
+        case 'B':
+          return CH_RESPONSE;
+        case 'A':
+          return GA_RESPONSE;
+        default:
+          return std::nullopt;
+      }
+    }
+
+    enum MessageType : uint8_t {
+      // Request
+      READ_DATA = 0b0000,
+      WRITE_DATA = 0b0001,
+      INVALID_DATA = 0b0010,
+      RESERVED = 0b0011,
+
+      // Response
+      READ_ACK = 0b0100,
+      WRITE_ACK = 0b0101,
+      DATA_INVALID = 0b0110,
+      UNKNOWN_DATAID = 0b0111,
+    };
+    constexpr static std::array<char const *, 8> MESSAGE_TYPE{
+      "READ_DATA",
+      "WRITE_DATA",
+      "INVALID_DATA",
+      "RESERVED",
+      "READ_ACK",
+      "WRITE_ACK",
+      "DATA_INVALID",
+      "UNKNOWN_DATAID",
+    };
+    uint8_t master_data_type = 0;
+    uint8_t slave_data_type = 0;
+    struct Message {
+      MessageType message_type;
+      uint16_t data;
+      // Time the line was received, in ms
+      uint32_t time;
+      // How long the line may have waited in the UART before that, in ms
+      uint16_t uncertainty;
+    };
+    using Messages = std::array<std::optional<Message>, 4>;
+    Messages data;
+  };
+  std::optional<Transaction> _current_transaction;
+  Transaction::Step _last_transaction_step;
+  uint64_t _time_last_line = 0;
+  // Last time the UART was seen empty. A line started after that also arrived after it, which bounds
+  // when lines arrived that are handled late, e.g. after a slow loop or because of the line budget.
+  uint64_t _time_receive_idle = 0;
+  // _time_receive_idle when the first byte of the line in the receive buffer was read
+  uint64_t _time_line_arrived_after = 0;
+  // The boiler has to respond within 800ms and messages are sent about every second, so anything
+  // received later than this belongs to another transaction
+  static constexpr uint32_t TRANSACTION_TIMEOUT = 900;
+  static constexpr uint32_t GATEWAY_RESPONSE_TIMEOUT = 100;
+  // Response times and gateway delays are only measured between lines timestamped at least this
+  // precisely. When polling that is about one loop, lines that waited longer are left out.
+  static constexpr uint16_t RESPONSE_TIME_RESOLUTION = 20;
+  // In monitor mode the gateway does not alter any messages, so there are no R and A lines
+  bool _gateway_mode = true;
+
+  // Information to keep track of which data types are available
+  struct DataTypeInfo {
+    struct ReadableInfo {
+      uint16_t interval;
+      std::optional<uint32_t> time_last_received;
+    };
+    std::optional<ReadableInfo> readable_info;
+
+    // Only allocated when statistics are enabled
+    struct Statistics {
+      uint32_t received = 0;
+      uint32_t requested_by_gateway = 0;
+      uint32_t failures = 0;
+      uint32_t min_interval = UINT32_MAX;
+      uint32_t max_interval = 0;
+      uint64_t total_interval = 0;
+      uint64_t time_last_received = 0;
+      uint16_t last_value = 0;
+
+      // Time between the request to the boiler and its response. The buckets are halved when one
+      // of them is full, so older responses weigh less and less.
+      static constexpr std::array<uint16_t, 7> RESPONSE_TIME_BUCKETS{50, 100, 200, 300, 400, 600, 800};
+      std::array<uint16_t, RESPONSE_TIME_BUCKETS.size() + 1> response_time_histogram{};
+      uint16_t max_response_time = 0;
+    };
+    std::unique_ptr<Statistics> statistics;
+
+    uint8_t consecutive_failures = 0;
+    bool interest = false;
+    bool supported = true;
+  };
+  std::unordered_map<uint8_t, DataTypeInfo> _data_types;
+  bool _statistics_enabled = false;
+  uint8_t _frame_log_level = 0;
+
+  struct DataTypeRequest {
+    uint8_t data_type;
+    uint32_t time_of_request;
+    bool priority_message = false;
+  };
+  std::optional<DataTypeRequest> _data_type_request;
+  bool _ready_for_requests = false;
+  // Set when there was nothing to request, until the next frame changes that
+  bool _requests_exhausted = false;
+  static constexpr uint32_t DATA_TYPE_REQUEST_TIMEOUT = 5 * 60;
+
+  // Counters backing the diagnostic sensors. These are updated for every line, so updating them
+  // should not allocate or log
+  struct Metrics {
+    std::array<uint32_t, 4> frames{};
+    uint32_t parse_errors = 0;
+    uint32_t transaction_mismatches = 0;
+    // Lines lost on the way, seen as transactions that lack a line the gateway always sends
+    uint32_t dropped_lines = 0;
+    uint32_t overrun_errors = 0;
+    uint32_t unknown_command_errors = 0;
+    uint32_t syntax_errors = 0;
+    uint32_t dropped_commands = 0;
+    uint32_t priority_requests_issued = 0;
+    uint32_t priority_requests_fulfilled = 0;
+    uint32_t priority_requests_timed_out = 0;
+    uint32_t command_bytes = 0;
+    uint16_t command_queue_high_water_mark = 0;
+    uint16_t receive_backlog = 0;
+    uint32_t boiler_response_time_total = 0;
+    uint16_t boiler_response_time_max = 0;
+    uint16_t boiler_responses = 0;
+    uint32_t gateway_delay_total = 0;
+    uint16_t gateway_delays = 0;
+  };
+  Metrics _metrics;
+
+#ifdef USE_OTGW_PROFILER
+  LoopProfiler _profiler;
+#endif
+
+  FrameTrace _trace;
+
+  bool _reuse_master_slots = false;
+  bool _ignore_heater_overrides = false;
+
+  // The gateway sends the data types in its alternatives table to the boiler by itself, in the slots
+  // of data types the boiler does not support. Frequently read data types are kept in that table so
+  // they need no PM, which is then only used when a value is late. When there are more of them than
+  // fit the table is rotated.
+  bool _use_alternatives = false;
+  // Without PM alternatives are the only way to request data types
+  bool alternatives_enabled() const {
+    return (_use_alternatives || !has_capability(PRIORITY_MESSAGE)) && has_capability(ALTERNATIVES);
+  }
+  std::vector<uint8_t> _alternatives;
+  // Lowered when the gateway replies NS, the table can also hold entries of other tools. Those may be
+  // removed later, so the full size is tried again after a while.
+  uint8_t _alternatives_capacity = MAX_ALTERNATIVES;
+  uint32_t _time_alternatives_rotated = 0;
+  std::optional<uint32_t> _time_alternatives_rejected;
+  static constexpr uint8_t MAX_ALTERNATIVES = 32;
+  static constexpr uint32_t ALTERNATIVES_ROTATION_INTERVAL = 60;
+  static constexpr uint32_t ALTERNATIVES_RETRY_INTERVAL = 60 * 60;
+  // Data types read at least this often (in minutes) are kept in the table
+  static constexpr uint16_t MAX_ALTERNATIVE_INTERVAL = static_cast<uint16_t>(data_types::Interval::MEDIUM);
+
+  // In summary mode the gateway stops reporting messages and prints one line with the last value of
+  // the common data types whenever PS=1 is sent
+  enum class SummaryFormat : uint8_t {
+    FLAGS, // Two bytes as 8 binary digits, separated by a slash
+    BYTES, // Two signed bytes, separated by a slash
+    F88,
+    U16,
+  };
+  struct SummaryField {
+    uint8_t data_type;
+    SummaryFormat format;
+    // Values written by the thermostat rather than read from the boiler
+    bool master;
+  };
+  static const std::array<SummaryField, 25> SUMMARY_FIELDS;
+  uint32_t _summary_interval = 0;
+  std::optional<uint64_t> _time_summary_requested;
+
+  // Taken from the version reported by PR=A, the newest entry not newer than the firmware applies.
+  // Until the version is known, or when it can't be parsed, everything is assumed to be available.
+  struct FirmwareCapabilities {
+    uint8_t major;
+    uint8_t minor;
+    uint8_t capabilities;
+  };
+  static const std::array<FirmwareCapabilities, 3> KNOWN_FIRMWARES;
+  // Start of the line printed after a reset, followed by the version
+  static constexpr char const *GATEWAY_BANNER = "OpenTherm Gateway ";
+  static constexpr uint8_t ALL_CAPABILITIES = PRIORITY_MESSAGE | UNKNOWN_IDS | ALTERNATIVES | SUMMARY | SECOND_CIRCUIT;
+  uint8_t _capabilities = ALL_CAPABILITIES;
+
+  Clock _clock;
+
+  uint64_t now_ms() const { return _clock(); }
+
+  // Rollover of 139 years, should be plenty
+  uint32_t seconds() const { return now_ms() / 1000; }
+
+  // Frames are 9 characters, summary lines about 200
+  static constexpr uint16_t MAX_BUFFER_SIZE = 256;
+  std::string _receive_buffer;
+  // Set after an overlong line filled the buffer, until its line end
+  bool _discarding_line = false;
+
+  // Limits on the amount of received data handled per loop, the rest stays in the UART buffer until
+  // the next loop. 0 means no limit.
+  uint16_t _max_bytes_per_loop = 0;
+  uint16_t _max_lines_per_loop = 8;
+  uint32_t _max_time_per_loop = 0;
+
+  static constexpr uint16_t MAX_COMMAND_QUEUE_LENGTH = 20;
+  std::vector<std::string> _command_queue;
+  std::optional<std::string> _send_command;
+  uint16_t _lines_since_command = 0;
+
+  uint64_t _next_deadline = 0;
+
+  ///// Serial connection to the gateway /////
+  virtual int serial_available() = 0;
+  // Returns -1 when nothing was received
+  virtual int serial_read() = 0;
+  virtual void serial_write(std::string const &data) = 0;
+
+  // Every line received from the gateway, before it is parsed
+  virtual void handle_line(std::string const & /*line*/) {}
+
+  ///// Decoded values, return whether the data type was handled /////
+  virtual bool handle_slave_response(uint8_t /*data_type*/, uint16_t /*data*/) { return false; }
+  virtual bool handle_master_request(uint8_t /*data_type*/, uint16_t /*data*/) { return false; }
+  virtual bool handle_gateway_response(uint8_t /*data_type*/, uint16_t /*data*/) { return false; }
+
+  // Value of a PR report other than the mode, which the core handles itself
+  virtual void handle_print_report(char /*code*/, std::string const & /*value*/) {}
+  // Successful reply to any other command
+  virtual void handle_command_reply(std::string const & /*command_code*/, std::string const & /*line*/) {}
+  // Called when no command is pending, before the next PM request is scheduled
+  virtual void handle_idle() {}
+  // Time at which handle_idle() has work to do
+  virtual uint64_t idle_deadline() { return UINT64_MAX; }
+  // The gateway printed its banner after a reset and forgot the settings it does not keep in EEPROM,
+  // e.g. the overrides. The alternatives table and the unknown data types are kept.
+  virtual void handle_gateway_reset() {}
+
+  void send_next_command();
+  void schedule_data_type_request();
+  bool is_alternative(uint8_t data_type) const;
+  bool wants_alternative(DataTypeInfo const &info) const;
+  void update_alternatives();
+  void alternative_rejected(uint8_t data_type);
+  void gateway_reset(std::string const &banner);
+  void request_summary();
+  void detect_capabilities(std::string const &version);
+  static uint8_t capability_of(char const *command);
+  void parse_summary(std::string const &line);
+  void update_next_deadline();
+  // Can be replaced when lines are received some other way, e.g. by a separate task
+  virtual void read_available();
+  bool is_error_code(std::string const &command_code);
+  bool is_error(std::string const &command_code);
+  void requeue_command(std::string const &command);
+  void update_queue_high_water_mark();
+  void parse_command_response(std::string const &line);
+  void handle_transaction(Transaction const &transaction);
+  void handle_transaction_messages(uint8_t data_type, Transaction::Messages data, bool requested_by_gateway = false);
+  void update_statistics(DataTypeInfo::Statistics &statistics, bool supported, bool requested_by_gateway, uint16_t value);
+  void record_response_times(Transaction const &transaction);
+  void parse_line(std::string const &line);
+  void count_line_since_command();
+  // A frame received at time now, e.g. T80000200 is TH_REQUEST with 0x80000200. It arrived no earlier
+  // than arrived_after, which is before now when the frame waited in the UART.
+  void handle_frame(Transaction::Step transaction_step, uint32_t message, uint64_t now, uint64_t arrived_after);
+  void finalize_transaction();
+  uint32_t transaction_timeout() const;
+};
+
+}  // namespace otgw
+}  // namespace esphome
@@ -0,0 +1,30 @@
+#pragma once
+
+// The protocol core logs through the ESPHome logger. When it is built outside of ESPHome, with
+// OTGW_STANDALONE defined, the same macros write to stderr instead.
+#ifdef OTGW_STANDALONE
+
+#include <cstdio>
+
+// Same levels as ESPHome, messages above this level are compiled out
+#ifndef OTGW_LOG_LEVEL
+#define OTGW_LOG_LEVEL 3
+#endif
+
+#define OTGW_STANDALONE_LOG(level, letter, tag, format, ...) \
+  do { \
+    if ((level) <= OTGW_LOG_LEVEL) \
+      fprintf(stderr, "[" letter "][%s]: " format "\n", tag, ##__VA_ARGS__); \
+  } while (0)
+
+#define ESP_LOGE(tag, ...) OTGW_STANDALONE_LOG(1, "E", tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) OTGW_STANDALONE_LOG(2, "W", tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) OTGW_STANDALONE_LOG(3, "I", tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) OTGW_STANDALONE_LOG(5, "D", tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) OTGW_STANDALONE_LOG(6, "V", tag, __VA_ARGS__)
+
+#else
+
+#include "esphome/core/log.h"
+
+#endif
@@ -0,0 +1,161 @@
+#include "passthrough.h"
+
+#ifdef USE_OTGW_PASSTHROUGH
+
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cerrno>
+
+namespace esphome {
+namespace otgw {
+
+void PassthroughServer::setup() {
+  _buffer.resize(_buffer_size);
+  _clients.reserve(MAX_CLIENTS);
+
+  _server = socket::socket_ip(SOCK_STREAM, 0);
+  if (_server == nullptr) {
+    ESP_LOGE("otgw", "Could not create the passthrough socket");
+    return;
+  }
+
+  int enable = 1;
+  _server->setsockopt(SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  _server->setblocking(false);
+
+  struct sockaddr_storage address;
+  socklen_t length = socket::set_sockaddr_any(reinterpret_cast<struct sockaddr *>(&address), sizeof(address), _port);
+  if (
+    _server->bind(reinterpret_cast<struct sockaddr *>(&address), length) != 0 ||
+    _server->listen(MAX_CLIENTS) != 0
+  ) {
+    ESP_LOGE("otgw", "Could not listen on passthrough port %u: errno %d", _port, errno);
+    _server = nullptr;
+    return;
+  }
+  ESP_LOGI("otgw", "Passthrough listening on port %u", _port);
+}
+
+void PassthroughServer::loop() {
+  if (_server == nullptr) {
+    return;
+  }
+
+  accept_clients();
+
+  for (auto it = _clients.begin(); it != _clients.end();) {
+    if (read_commands(*it) && write_lines(*it)) {
+      ++it;
+    } else {
+      it->socket->close();
+      it = _clients.erase(it);
+    }
+  }
+}
+
+void PassthroughServer::accept_clients() {
+  while (true) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    auto socket = _server->accept(reinterpret_cast<struct sockaddr *>(&address), &length);
+    if (socket == nullptr) {
+      return;
+    }
+
+    if (_clients.size() == MAX_CLIENTS) {
+      ESP_LOGW("otgw", "Refused passthrough client, already serving %u", MAX_CLIENTS);
+      socket->close();
+      continue;
+    }
+
+    socket->setblocking(false);
+    // New clients start with the next line
+    _clients.push_back(Client{std::move(socket), _head, {}});
+    ESP_LOGD("otgw", "Passthrough client connected");
+  }
+}
+
+bool PassthroughServer::read_commands(Client &client) {
+  char data[32];
+  while (true) {
+    ssize_t length = client.socket->read(data, sizeof(data));
+    if (length == 0) {
+      ESP_LOGD("otgw", "Passthrough client disconnected");
+      return false;
+    }
+    if (length < 0) {
+      return errno == EWOULDBLOCK || errno == EAGAIN;
+    }
+
+    for (ssize_t i = 0; i != length; ++i) {
+      char c = data[i];
+      if (c != '\r' && c != '\n') {
+        // Overlong commands are dropped at the next line end
+        if (client.command.size() <= MAX_COMMAND_LENGTH) {
+          client.command += c;
+        }
+        continue;
+      }
+
+      if (client.command.empty()) {
+        continue;
+      }
+
+      // Commands look like "XX=<value>"
+      if (client.command.size() <= MAX_COMMAND_LENGTH && client.command.size() >= 4 && client.command[2] == '=') {
+        ESP_LOGD("otgw", "Passthrough command %s", client.command.c_str());
+        _command_callback(client.command.substr(0, 2), client.command.substr(3));
+      } else {
+        ESP_LOGW("otgw", "Ignored invalid passthrough command");
+      }
+      client.command.clear();
+    }
+  }
+}
+
+bool PassthroughServer::write_lines(Client &client) {
+  while (client.cursor != _head) {
+    uint64_t pending = _head - client.cursor;
+    if (pending > _buffer.size()) {
+      ESP_LOGW("otgw", "Disconnected passthrough client that could not keep up");
+      return false;
+    }
+
+    // Write up to the end of the buffer, the rest follows in the next iteration
+    uint16_t start = client.cursor % _buffer.size();
+    size_t length = std::min<size_t>(pending, _buffer.size() - start);
+    ssize_t written = client.socket->write(_buffer.data() + start, length);
+    if (written < 0) {
+      return errno == EWOULDBLOCK || errno == EAGAIN;
+    }
+
+    client.cursor += written;
+    if (static_cast<size_t>(written) != length) {
+      // The socket buffer is full, continue in the next loop
+      return true;
+    }
+  }
+  return true;
+}
+
+void PassthroughServer::push_line(std::string const &line) {
+  if (_clients.empty()) {
+    return;
+  }
+
+  push(line.data(), line.size());
+  push("\r\n", 2);
+}
+
+void PassthroughServer::push(char const *data, size_t length) {
+  for (size_t i = 0; i != length; ++i) {
+    _buffer[(_head + i) % _buffer.size()] = data[i];
+  }
+  _head += length;
+}
+
+}  // namespace otgw
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#ifdef USE_OTGW_PASSTHROUGH
+
+#include "esphome/components/socket/socket.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace otgw {
+
+// Serves the raw lines of the gateway over TCP, like the serial server of OTmonitor, so other tools
+// can keep working while the component owns the UART.
+//
+// Lines are copied once into a ring buffer shared by all clients, every client only has a cursor
+// into it. Clients that fall more than the buffer size behind are disconnected, so a slow client
+// never blocks the loop or holds memory. Commands received from clients are handed to the command
+// callback, which queues them with the commands of the component.
+class PassthroughServer {
+ public:
+  using CommandCallback = std::function<void(std::string const &command, std::string const &parameter)>;
+
+  void set_port(uint16_t port) { _port = port; }
+  // The server is only started for gateways that were given a port
+  bool is_enabled() const { return _port != 0; }
+  void set_buffer_size(uint16_t size) { _buffer_size = size; }
+  void set_command_callback(CommandCallback &&callback) { _command_callback = std::move(callback); }
+
+  void setup();
+  void loop();
+
+  // Called for every line received from the gateway, without line end
+  void push_line(std::string const &line);
+
+ protected:
+  static constexpr uint8_t MAX_CLIENTS = 4;
+  static constexpr uint8_t MAX_COMMAND_LENGTH = 32;
+
+  struct Client {
+    std::unique_ptr<socket::Socket> socket;
+    // Position in the stream of lines, the buffer index is cursor % buffer size
+    uint64_t cursor;
+    std::string command;
+  };
+
+  uint16_t _port = 0;
+  uint16_t _buffer_size = 1024;
+  CommandCallback _command_callback;
+
+  std::unique_ptr<socket::Socket> _server;
+  std::vector<Client> _clients;
+  std::vector<char> _buffer;
+  // Number of bytes written to the buffer since the start
+  uint64_t _head = 0;
+
+  void accept_clients();
+  // Return false when the client should be disconnected
+  bool read_commands(Client &client);
+  bool write_lines(Client &client);
+  void push(char const *data, size_t length);
+};
+
+}  // namespace otgw
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+#ifdef USE_OTGW_PROFILER
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <array>
+#include <cinttypes>
+#include <cstdint>
+
+namespace esphome {
+namespace otgw {
+
+// Measures how long the stages of OpenthermGateway::loop() take, in CPU cycles. Only compiled in
+// when USE_OTGW_PROFILER is defined, otherwise OTGW_PROFILE() expands to nothing. The define compiles
+// it in for all gateways, only the ones that enable it record. The profiler needs the ESPHome HAL, so
+// it is not available to standalone builds of the protocol core.
+class LoopProfiler {
+ public:
+  enum Stage : uint8_t {
+    LOOP = 0,
+    READ_AVAILABLE = 1,
+    PARSE_LINE = 2,
+    PUBLISH = 3,
+  };
+  constexpr static std::array<char const *, 4> STAGE{"loop", "read_available", "parse_line", "publish"};
+
+  // Bucket i counts durations below 2^i microseconds, the last bucket everything above
+  static constexpr uint8_t BUCKETS = 18;
+
+  struct StageInfo {
+    std::array<uint32_t, BUCKETS> histogram{};
+    uint32_t count = 0;
+    uint64_t total_cycles = 0;
+    uint32_t max_cycles = 0;
+  };
+
+  // Durations of all stages during the slowest loop() seen so far
+  struct WorstCase {
+    std::array<uint32_t, 4> cycles{};
+    uint32_t time = 0;
+  };
+
+  void enable(bool enable) { _enabled = enable; }
+
+  void record(Stage stage, uint32_t cycles) {
+    if (!_enabled) {
+      return;
+    }
+    auto &info = _stages[stage];
+    info.count++;
+    info.total_cycles += cycles;
+    if (cycles > info.max_cycles) {
+      info.max_cycles = cycles;
+    }
+
+    uint32_t micros = cycles_to_us(cycles);
+    uint8_t bucket = 0;
+    while (bucket < BUCKETS - 1 && micros >= (1u << bucket)) {
+      bucket++;
+    }
+    info.histogram[bucket]++;
+
+    _current[stage] += cycles;
+    if (stage == LOOP) {
+      if (cycles > _worst_case.cycles[LOOP]) {
+        _worst_case.cycles = _current;
+        _worst_case.time = millis();
+      }
+      _current.fill(0);
+    }
+  }
+
+  void dump() const {
+    if (!_enabled) {
+      return;
+    }
+    ESP_LOGI("otgw", "Loop profile (microseconds):");
+    for (uint8_t stage = 0; stage != 4; ++stage) {
+      auto const &info = _stages[stage];
+      if (info.count == 0) {
+        continue;
+      }
+
+      ESP_LOGI("otgw", "  %s: count %" PRIu32 ", avg %" PRIu32 ", max %" PRIu32, STAGE[stage], info.count,
+               cycles_to_us(info.total_cycles / info.count), cycles_to_us(info.max_cycles));
+      for (uint8_t bucket = 0; bucket != BUCKETS; ++bucket) {
+        if (info.histogram[bucket] == 0) {
+          continue;
+        }
+        if (bucket == BUCKETS - 1) {
+          ESP_LOGI("otgw", "    >= %7" PRIu32 ": %" PRIu32, uint32_t{1} << (bucket - 1), info.histogram[bucket]);
+        } else {
+          ESP_LOGI("otgw", "    <  %7" PRIu32 ": %" PRIu32, uint32_t{1} << bucket, info.histogram[bucket]);
+        }
+      }
+    }
+
+    ESP_LOGI("otgw", "  Slowest loop at %" PRIu32 " ms: loop %" PRIu32 ", read_available %" PRIu32
+             ", parse_line %" PRIu32 ", publish %" PRIu32, _worst_case.time,
+             cycles_to_us(_worst_case.cycles[LOOP]), cycles_to_us(_worst_case.cycles[READ_AVAILABLE]),
+             cycles_to_us(_worst_case.cycles[PARSE_LINE]), cycles_to_us(_worst_case.cycles[PUBLISH]));
+  }
+
+  static uint32_t cycles_to_us(uint64_t cycles) { return cycles / (arch_get_cpu_freq_hz() / 1'000'000); }
+
+ protected:
+  std::array<StageInfo, 4> _stages;
+  std::array<uint32_t, 4> _current{};
+  WorstCase _worst_case;
+  bool _enabled = false;
+};
+
+class LoopProfilerScope {
+ public:
+  LoopProfilerScope(LoopProfiler &profiler, LoopProfiler::Stage stage)
+      : _profiler(profiler), _stage(stage), _start(arch_get_cpu_cycle_count()) {}
+  ~LoopProfilerScope() { _profiler.record(_stage, arch_get_cpu_cycle_count() - _start); }
+
+ protected:
+  LoopProfiler &_profiler;
+  LoopProfiler::Stage _stage;
+  uint32_t _start;
+};
+
+#define OTGW_PROFILE(stage) LoopProfilerScope otgw_profiler_scope_(_profiler, LoopProfiler::stage)
+
+}  // namespace otgw
+}  // namespace esphome
+
+#else
+
+#define OTGW_PROFILE(stage)
+
+#endif
@@ -9,6 +9,7 @@ from esphome.const import (
     UNIT_HOUR,
     UNIT_HERTZ,
     UNIT_AMPERE,
+    UNIT_MILLISECOND,
     DEVICE_CLASS_TEMPERATURE,
     DEVICE_CLASS_ENERGY,
     DEVICE_CLASS_DURATION,
@@ -18,11 +19,34 @@ from esphome.const import (
     DEVICE_CLASS_HUMIDITY,
     STATE_CLASS_TOTAL_INCREASING,
     STATE_CLASS_MEASUREMENT,
+    ENTITY_CATEGORY_DIAGNOSTIC,
 )
-from . import OpenthermGateway, CONF_OTGW_ID
+from . import OpenthermGateway, CONF_OTGW_ID, otgw_ns
 
 AUTO_LOAD = ["otgw"]
 
+CONF_CUSTOM = "custom"
+CONF_DATA_ID = "data_id"
+CONF_FORMAT = "format"
+CONF_INTERVAL = "interval"
+
+CustomFormat = otgw_ns.enum("CustomFormat", is_class=True)
+CUSTOM_FORMATS = {
+    "f8.8": CustomFormat.F88,
+    "u16": CustomFormat.U16,
+    "s16": CustomFormat.S16,
+    "hb": CustomFormat.HB,
+    "lb": CustomFormat.LB,
+}
+
+# Data types that have no sensor of their own, e.g. OEM specific ones
+CUSTOM_SENSOR_SCHEMA = sensor.sensor_schema().extend({
+    cv.Required(CONF_DATA_ID): cv.uint8_t,
+    cv.Required(CONF_FORMAT): cv.enum(CUSTOM_FORMATS, lower=True),
+    # How often the data type is requested when the thermostat does not
+    cv.Optional(CONF_INTERVAL, default="10min"): cv.positive_time_period_minutes,
+})
+
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(CONF_OTGW_ID): cv.use_id(OpenthermGateway),
 
@@ -254,6 +278,121 @@ CONFIG_SCHEMA = cv.Schema({
         accuracy_decimals=2,
         state_class=STATE_CLASS_MEASUREMENT,
     ),
+
+    # Diagnostics
+    cv.Optional("thermostat_frames_per_minute"): sensor.sensor_schema(
+        unit_of_measurement="frames/min",
+        accuracy_decimals=1,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("gateway_request_frames_per_minute"): sensor.sensor_schema(
+        unit_of_measurement="frames/min",
+        accuracy_decimals=1,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("boiler_frames_per_minute"): sensor.sensor_schema(
+        unit_of_measurement="frames/min",
+        accuracy_decimals=1,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("gateway_response_frames_per_minute"): sensor.sensor_schema(
+        unit_of_measurement="frames/min",
+        accuracy_decimals=1,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("command_bytes_per_minute"): sensor.sensor_schema(
+        unit_of_measurement="B/min",
+        accuracy_decimals=1,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("parse_errors"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("transaction_mismatches"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("dropped_lines"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("command_queue_depth"): sensor.sensor_schema(
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("command_queue_high_water_mark"): sensor.sensor_schema(
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("overrun_errors"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("unknown_command_errors"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("syntax_errors"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("dropped_commands"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("suppressed_outside_temperature_commands"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("suppressed_time_commands"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("priority_requests_issued"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("priority_requests_fulfilled"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("priority_requests_timed_out"): sensor.sensor_schema(
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("receive_backlog"): sensor.sensor_schema(
+        unit_of_measurement="B",
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    # Measured between the receive times of lines, which are precise to about one loop (or exact with
+    # reader_task), see RESPONSE_TIME_RESOLUTION
+    cv.Optional("boiler_response_time"): sensor.sensor_schema(
+        unit_of_measurement=UNIT_MILLISECOND,
+        device_class=DEVICE_CLASS_DURATION,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("max_boiler_response_time"): sensor.sensor_schema(
+        unit_of_measurement=UNIT_MILLISECOND,
+        device_class=DEVICE_CLASS_DURATION,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    cv.Optional("gateway_delay"): sensor.sensor_schema(
+        unit_of_measurement=UNIT_MILLISECOND,
+        device_class=DEVICE_CLASS_DURATION,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+
+    cv.Optional(CONF_CUSTOM): cv.ensure_list(CUSTOM_SENSOR_SCHEMA),
 })
 
 async def to_code(config):
@@ -267,3 +406,7 @@ async def to_code(config):
         if id and id.type == sensor.Sensor:
             sens = await sensor.new_sensor(conf)
             cg.add(getattr(hub, f"set_sensor({hub}->{key}, {sens})"))
+
+    for conf in config.get(CONF_CUSTOM, []):
+        sens = await sensor.new_sensor(conf)
+        cg.add(hub.add_custom_sensor(sens, conf[CONF_DATA_ID], conf[CONF_FORMAT], conf[CONF_INTERVAL].total_minutes))
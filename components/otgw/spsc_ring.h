@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace otgw {
+
+// Lock-free queue for exactly one producer and one consumer, e.g. a reader task and loop(). The
+// producer only writes _head and the consumer only writes _tail, so no locks are needed.
+template<typename Item, size_t SIZE>
+class SpscRing {
+  static_assert(SIZE != 0 && (SIZE & (SIZE - 1)) == 0, "The size must be a power of two");
+
+ public:
+  // Producer only, returns false when the ring is full
+  bool push(Item const &item) {
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) == SIZE) {
+      return false;
+    }
+
+    _items[head & (SIZE - 1)] = item;
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only, returns false when the ring is empty
+  bool pop(Item &item) {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    item = _items[tail & (SIZE - 1)];
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const { return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire); }
+
+ protected:
+  std::array<Item, SIZE> _items;
+  std::atomic<uint32_t> _head{0};
+  std::atomic<uint32_t> _tail{0};
+};
+
+}  // namespace otgw
+}  // namespace esphome
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "otgw_log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace otgw {
+
+// Per line and per transaction logging is very verbose and formatting it is relatively expensive, so
+// it is compiled out unless frame_log_level is set in the yaml. Use the frame trace for a cheap
+// record of the traffic instead. OTGW_FRAME_LOG_LEVEL is the highest level of all gateways, each
+// gateway only logs at its own _frame_log_level.
+#ifndef OTGW_FRAME_LOG_LEVEL
+#define OTGW_FRAME_LOG_LEVEL 0
+#endif
+
+#if OTGW_FRAME_LOG_LEVEL != 0
+#define OTGW_LOG_FRAME(...) \
+  do { \
+    if (_frame_log_level == 1) { \
+      ESP_LOGD("otgw", __VA_ARGS__); \
+    } else if (_frame_log_level == 2) { \
+      ESP_LOGV("otgw", __VA_ARGS__); \
+    } \
+  } while (false)
+#else
+#define OTGW_LOG_FRAME(...)
+#endif
+
+// Fixed size ring buffer, memory is only allocated when a capacity is set
+template<typename Entry>
+class TraceRing {
+ public:
+  void set_capacity(uint16_t capacity) {
+    _entries.clear();
+    _entries.shrink_to_fit();
+    _entries.reserve(capacity);
+    _capacity = capacity;
+    _next = 0;
+  }
+
+  uint16_t capacity() const { return _capacity; }
+  uint16_t size() const { return _entries.size(); }
+
+  void push(Entry &&entry) {
+    if (_capacity == 0) {
+      return;
+    }
+
+    if (_entries.size() < _capacity) {
+      _entries.push_back(std::move(entry));
+    } else {
+      _entries[_next] = std::move(entry);
+    }
+    _next = (_next + 1) % _capacity;
+  }
+
+  // Oldest entry first
+  Entry const &operator[](uint16_t index) const {
+    uint16_t start = _entries.size() < _capacity ? 0 : _next;
+    return _entries[(start + index) % _entries.size()];
+  }
+
+ protected:
+  std::vector<Entry> _entries;
+  uint16_t _capacity = 0;
+  uint16_t _next = 0;
+};
+
+// Record of the most recent raw frames received from the gateway and of the commands exchanged with it.
+// Storing a frame is a couple of integer writes, formatting only happens when the trace is dumped.
+//
+// The dump is also the capture format read by tools/otgw_simulator.py --replay, one record per line:
+//   <timestamp in ms> <T|R|B|A><frame as 8 hex digits>
+//   <timestamp in ms> > <command sent to the gateway>
+//   <timestamp in ms> < <reply from the gateway>
+class FrameTrace {
+ public:
+  struct Frame {
+    uint32_t timestamp;
+    uint32_t frame;
+    char step;
+  };
+
+  struct Command {
+    uint32_t timestamp;
+    char direction;
+    std::string line;
+  };
+
+  // Commands are much rarer than frames, so fewer of them are kept
+  void set_capacity(uint16_t capacity) {
+    _frames.set_capacity(capacity);
+    _commands.set_capacity(capacity == 0 ? 0 : std::max(capacity / 8, 8));
+  }
+
+  bool enabled() const { return _frames.capacity() != 0; }
+
+  void record(uint32_t timestamp, uint32_t frame, char step) { _frames.push(Frame{timestamp, frame, step}); }
+
+  void record_command(uint32_t timestamp, char direction, std::string const &line) {
+    // Strip the line end of sent commands
+    _commands.push(Command{timestamp, direction, line.substr(0, line.find_first_of("\r\n"))});
+  }
+
+  void dump() const {
+    ESP_LOGI("otgw", "Frame trace (%u frames, %u commands):", static_cast<unsigned>(_frames.size()),
+             static_cast<unsigned>(_commands.size()));
+
+    // Both buffers are in chronological order, merge them. The timestamps wrap after 49 days, so they
+    // are compared by their difference.
+    uint16_t frame = 0;
+    uint16_t command = 0;
+    while (frame != _frames.size() || command != _commands.size()) {
+      if (
+        command == _commands.size() ||
+        (frame != _frames.size() && static_cast<int32_t>(_frames[frame].timestamp - _commands[command].timestamp) <= 0)
+      ) {
+        auto const &entry = _frames[frame++];
+        ESP_LOGI("otgw", "%10" PRIu32 " %c%08" PRIX32, entry.timestamp, entry.step, entry.frame);
+      } else {
+        auto const &entry = _commands[command++];
+        ESP_LOGI("otgw", "%10" PRIu32 " %c %s", entry.timestamp, entry.direction, entry.line.c_str());
+      }
+    }
+  }
+
+ protected:
+  TraceRing<Frame> _frames;
+  TraceRing<Command> _commands;
+};
+
+}  // namespace otgw
+}  // namespace esphome
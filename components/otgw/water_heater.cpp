@@ -1,5 +1,7 @@
 #include "water_heater.h"
 
+#include <cmath>
+
 namespace esphome {
 namespace otgw {
 
@@ -29,15 +31,33 @@ OpenthermGatewayWaterHeater::OpenthermGatewayWaterHeater(bool eco_mode) {
 }
 
 void OpenthermGatewayWaterHeater::control(const water_heater::WaterHeaterCall &call) {
-  if (call.get_mode().has_value()) {
+  // Only the parts that changed since they were last sent go to the gateway, resending the same mode
+  // or target costs commands on a link that handles about one per second. The state only mirrors the
+  // bus, so it can not tell.
+  bool mode_changed = call.get_mode().has_value() && _commanded_mode.command(*call.get_mode());
+  float target_temperature = call.get_target_temperature();
+  bool target_changed = !std::isnan(target_temperature) && _commanded_target_temperature.command(target_temperature);
+
+  if (mode_changed) {
     set_mode_(*call.get_mode());
-    _mode_callback();
+  }
+  if (target_changed) {
+    set_target_temperature_(target_temperature);
   }
 
-  set_target_temperature_(call.get_target_temperature());
-  _target_callback();
+  // The target goes first, so the mode callback can skip it when it was already sent
+  if (target_changed) {
+    _target_callback();
+  }
+  if (mode_changed) {
+    _mode_callback();
+  }
 
-  this->publish_state();
+  // Every call with a mode or target is answered with the state, also an unchanged one, so the
+  // frontend falls back to the current values instead of waiting for a change
+  if (call.get_mode().has_value() || !std::isnan(target_temperature)) {
+    this->publish_state();
+  }
 }
 
 void OpenthermGatewayWaterHeater::set_cooling_supported(bool supported) {
@@ -45,6 +65,7 @@ void OpenthermGatewayWaterHeater::set_cooling_supported(bool supported) {
 }
 
 void OpenthermGatewayWaterHeater::set_target_temperature(float temperature) {
+  _commanded_target_temperature.report(temperature);
   this->target_temperature_ = temperature;
   this->publish_state();
 }
@@ -65,6 +86,7 @@ void OpenthermGatewayWaterHeater::set_current_temperature(float temperature) {
 }
 
 void OpenthermGatewayWaterHeater::set_mode(water_heater::WaterHeaterMode mode) {
+  _commanded_mode.report(mode);
   this->mode_ = mode;
   this->publish_state();
 }
@@ -77,6 +99,11 @@ void OpenthermGatewayWaterHeater::set_callbacks(
   _mode_callback = mode_callback;
 }
 
+void OpenthermGatewayWaterHeater::forget_commanded() {
+  _commanded_mode.forget();
+  _commanded_target_temperature.forget();
+}
+
 water_heater::WaterHeaterCallInternal OpenthermGatewayWaterHeater::make_call() {
   return water_heater::WaterHeaterCallInternal(this);
 }
@@ -2,6 +2,8 @@
 
 #include "esphome/components/water_heater/water_heater.h"
 
+#include "commanded_value.h"
+
 namespace esphome {
 namespace otgw {
 
@@ -10,6 +12,8 @@ class OpenthermGatewayWaterHeater : public Component, public water_heater::Water
   std::function<void()> _target_callback;
   std::function<void()> _mode_callback;
   water_heater::WaterHeaterTraits _traits;
+  CommandedValue<water_heater::WaterHeaterMode> _commanded_mode;
+  CommandedValue<float> _commanded_target_temperature;
 
  public:
   OpenthermGatewayWaterHeater(bool eco_mode);
@@ -25,6 +29,8 @@ class OpenthermGatewayWaterHeater : public Component, public water_heater::Water
   void set_mode(water_heater::WaterHeaterMode mode);
 
   void set_callbacks(decltype(_target_callback) &&target_callback, decltype(_mode_callback) &&mode_callback);
+  // The gateway was reset, the next call sends its mode and target again
+  void forget_commanded();
 
   water_heater::WaterHeaterTraits traits() override;
   water_heater::WaterHeaterCallInternal make_call() override;
@@ -0,0 +1,162 @@
+// Worst case throughput of the receive path of the protocol core, on adversarial input: a mix of
+// valid frames, random bytes, overlong lines, lines that look like command replies and summary lines.
+//
+// Reports the bytes and lines handled per second and the longest single process() call, which is
+// what the rest of the ESPHome loop waits for. Logging is compiled out, only the parsing is measured.
+//
+// Usage: otgw_bench_receive [--megabytes MB] [--seed SEED] [--summary] [--max-lines LINES]
+
+#include "otgw_core.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <random>
+#include <string>
+
+namespace esphome {
+namespace otgw {
+
+static uint64_t monotonic_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+class BenchGateway : public OpenthermGatewayCore {
+ public:
+  explicit BenchGateway(std::string const &input) : OpenthermGatewayCore(monotonic_ms), _input(input) {}
+
+  bool exhausted() const { return _position == _input.size(); }
+  uint32_t lines() const { return _lines; }
+
+ protected:
+  std::string const &_input;
+  size_t _position = 0;
+  uint32_t _lines = 0;
+
+  // Like a UART, which holds at most 256 bytes
+  int serial_available() override { return std::min<size_t>(_input.size() - _position, 256); }
+
+  int serial_read() override {
+    if (_position == _input.size()) {
+      return -1;
+    }
+    return static_cast<unsigned char>(_input[_position++]);
+  }
+
+  void serial_write(std::string const & /*data*/) override {}
+
+  void handle_line(std::string const & /*line*/) override { _lines++; }
+};
+
+}  // namespace otgw
+}  // namespace esphome
+
+using esphome::otgw::BenchGateway;
+
+static std::string adversarial_input(size_t size, uint32_t seed, bool summary) {
+  std::mt19937 random(seed);
+  std::string input;
+  input.reserve(size + 512);
+  char text[16];
+  while (input.size() < size) {
+    switch (random() % 6) {
+      case 0:
+      case 1:
+        // Valid frames, still the bulk of the traffic when the line is noisy
+        snprintf(text, sizeof(text), "%c%08" PRIX32 "\r\n", "TRBA"[random() % 4], static_cast<uint32_t>(random()));
+        input += text;
+        break;
+      case 2:
+        // Random bytes, including line ends
+        for (uint32_t i = random() % 64; i != 0; --i) {
+          input += static_cast<char>(random() % 256);
+        }
+        break;
+      case 3:
+        // Overlong line, longer than the receive buffer
+        input.append(200 + random() % 400, "TBX0"[random() % 4]);
+        input += "\r\n";
+        break;
+      case 4: {
+        // Looks like a reply to a command
+        static char const *const REPLIES[]{"PR: A=OpenTherm Gateway 4.2.5", "PR: ", "PR:", "CS: 45.00", "NG", "OE",
+                                           "XX: yes", "PR: Q", "PR: M=?"};
+        input += REPLIES[random() % (sizeof(REPLIES) / sizeof(REPLIES[0]))];
+        input += "\r\n";
+        break;
+      }
+      default:
+        if (summary) {
+          input += "00000001/00001010,45.00,00000000/00000000,100.00,24/20,20.00,40.00,1.60,19.53,45.00,52.00,8.00,"
+                   "38.00,65/40,90/20,55.00,80.00,1316,1317,1318,1319,8120,8121,8122,8123\r\n";
+        } else {
+          // A summary line cut short
+          input += "00000001/00001010,45.00,0000,\r\n";
+        }
+        break;
+    }
+  }
+  return input;
+}
+
+int main(int argc, char **argv) {
+  unsigned long megabytes = 4;
+  uint32_t seed = 1;
+  bool summary = false;
+  unsigned long max_lines = 8;
+
+  static option const options[] = {
+    {"megabytes", required_argument, nullptr, 'm'},
+    {"seed", required_argument, nullptr, 's'},
+    {"summary", no_argument, nullptr, 'S'},
+    {"max-lines", required_argument, nullptr, 'l'},
+    {nullptr, 0, nullptr, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "", options, nullptr)) != -1) {
+    switch (option) {
+      case 'm':
+        megabytes = strtoul(optarg, nullptr, 10);
+        break;
+      case 's':
+        seed = strtoul(optarg, nullptr, 10);
+        break;
+      case 'S':
+        summary = true;
+        break;
+      case 'l':
+        max_lines = strtoul(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [--megabytes MB] [--seed SEED] [--summary] [--max-lines LINES]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  std::string input = adversarial_input(megabytes << 20, seed, summary);
+  BenchGateway gateway(input);
+  gateway.set_summary_interval(summary ? 10'000 : 0);
+  gateway.set_max_lines_per_loop(max_lines);
+  gateway.begin();
+
+  using Clock = std::chrono::steady_clock;
+  Clock::duration max_loop{};
+  uint64_t loops = 0;
+  auto start = Clock::now();
+  while (!gateway.exhausted()) {
+    auto loop_start = Clock::now();
+    gateway.process();
+    max_loop = std::max(max_loop, Clock::now() - loop_start);
+    loops++;
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  printf("%zu bytes, %" PRIu32 " lines in %" PRIu64 " loops, %.3f s\n", input.size(), gateway.lines(), loops, seconds);
+  printf("%.1f MB/s, %.0f lines/s, longest loop %.1f us\n", input.size() / seconds / (1 << 20), gateway.lines() / seconds,
+         std::chrono::duration<double, std::micro>(max_loop).count());
+  return 0;
+}
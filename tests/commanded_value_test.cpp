@@ -0,0 +1,99 @@
+// Tests of the last commanded mode and target of the climate and water heater entities
+// (components/otgw/commanded_value.h).
+//
+// The entities mirror the bus, so their state may already show the value a call asks for while the
+// gateway does not have it. Each case feeds the reports of the bus and the calls in the order the
+// component sees them and checks which calls send a command.
+//
+// Usage: otgw_commanded_value
+
+#include "commanded_value.h"
+
+#include <cstdio>
+
+using esphome::otgw::CommandedValue;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (false)
+
+// Like climate::ClimateMode
+enum TestMode { MODE_AUTO, MODE_HEAT };
+
+// The thermostat already uses the target the call asks for, the gateway still has to be told
+static void test_current_reported_value() {
+  CommandedValue<float> target;
+  target.report(21);
+  CHECK(target.command(21));
+  CHECK(!target.command(21));
+
+  CommandedValue<TestMode> mode;
+  mode.report(MODE_AUTO);
+  CHECK(mode.command(MODE_AUTO));
+  CHECK(!mode.command(MODE_AUTO));
+}
+
+static void test_changes() {
+  CommandedValue<float> target;
+  CHECK(target.command(21));
+  // The bus catches up
+  target.report(21);
+  CHECK(!target.command(21));
+  CHECK(target.command(19.5));
+  CHECK(!target.command(19.5));
+  CHECK(target.command(21));
+}
+
+// The thermostat changed its program, which ends the override
+static void test_expired_override() {
+  CommandedValue<float> target;
+  CHECK(target.command(21));
+  target.report(21);
+  target.report(18);
+  CHECK(!target.value().has_value());
+  CHECK(target.command(21));
+
+  CommandedValue<TestMode> mode;
+  CHECK(mode.command(MODE_HEAT));
+  mode.report(MODE_AUTO);
+  CHECK(mode.command(MODE_HEAT));
+}
+
+// The gateway forgot the overrides, the state still shows them until the bus says otherwise
+static void test_gateway_reset() {
+  CommandedValue<float> target;
+  CHECK(target.command(21));
+  target.report(21);
+  target.forget();
+  target.report(21);
+  CHECK(target.command(21));
+  CHECK(!target.command(21));
+}
+
+// The bus reports f8.8, which is not exactly the value of the call
+static void test_rounding() {
+  CommandedValue<float> target;
+  CHECK(target.command(20.3f));
+  target.report(77 / 256.0f + 20);
+  CHECK(target.value().has_value());
+  CHECK(!target.command(20.3f));
+  target.report(20.25f);
+  CHECK(!target.value().has_value());
+}
+
+int main() {
+  test_current_reported_value();
+  test_changes();
+  test_expired_override();
+  test_gateway_reset();
+  test_rounding();
+
+  printf(failures == 0 ? "PASSED\n" : "FAILED\n");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Runs otgwd against tools/otgw_simulator.py --firmware for every entry of KNOWN_FIRMWARES.
+
+The entries are read from components/otgw/otgw_core.cpp. For each firmware the capability line that
+otgwd logs must list exactly the commands of the entry, and the simulator, which answers commands
+that firmware does not have with NG, must not have answered any command with NG.
+
+Usage: firmware_capabilities.py OTGWD SOURCE_DIRECTORY
+"""
+
+import os
+import re
+import select
+import signal
+import subprocess
+import sys
+import time
+
+IDS = "0,25:1,26:1,28:1,56:10"
+RUN_SECONDS = 12
+
+# Capability flags as logged by detect_capabilities()
+CAPABILITY_NAMES = [
+    ("PRIORITY_MESSAGE", "PM"),
+    ("UNKNOWN_IDS", "KI/UI"),
+    ("ALTERNATIVES", "AA/DA"),
+    ("SUMMARY", "PS"),
+    ("SECOND_CIRCUIT", "C2/H2"),
+]
+
+
+def known_firmwares(source):
+    with open(os.path.join(source, "components", "otgw", "otgw_core.cpp")) as file:
+        table = re.search(r"KNOWN_FIRMWARES\{\{(.*?)\}\};", file.read(), re.DOTALL).group(1)
+    for major, minor, flags in re.findall(r"\{(\d+), (\d+), ([A-Z_| ]+)\}", table):
+        flags = {flag.strip() for flag in flags.split("|")}
+        names = "".join(" " + name for flag, name in CAPABILITY_NAMES if flag in flags)
+        yield "%s.%s" % (major, minor), "Firmware %s.%s:%s" % (major, minor, names)
+
+
+def start_simulator(source, firmware):
+    simulator = subprocess.Popen(
+        [sys.executable, os.path.join(source, "tools", "otgw_simulator.py"), "--firmware", firmware, "--seed", "1"],
+        stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    # The first line names the pseudo-terminal
+    if not select.select([simulator.stderr], [], [], 10)[0]:
+        simulator.kill()
+        raise RuntimeError("the simulator did not start")
+    return simulator, simulator.stderr.readline().split()[-1]
+
+
+def start(otgwd, source, firmware):
+    simulator, device = start_simulator(source, firmware)
+    socket = "/tmp/otgwd-firmware-%s-%d.sock" % (firmware, os.getpid())
+    env = dict(os.environ, OTGW_LOG_LEVEL="3")
+    daemon = subprocess.Popen([otgwd, "--ids", IDS, "--socket", socket, device],
+                              stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True, env=env)
+    return simulator, daemon, socket
+
+
+def stop(simulator, daemon, socket):
+    daemon.terminate()
+    # The simulator prints its statistics when interrupted
+    simulator.send_signal(signal.SIGINT)
+    log = daemon.communicate(timeout=10)[1]
+    statistics = simulator.communicate(timeout=10)[1]
+    if os.path.exists(socket):
+        os.unlink(socket)
+    return log.splitlines(), statistics.strip()
+
+
+def main():
+    otgwd, source = sys.argv[1:3]
+    failures = []
+    firmwares = list(known_firmwares(source))
+    if not firmwares:
+        failures.append("no entries found in KNOWN_FIRMWARES")
+
+    # All firmwares at once, each with its own simulator
+    runs = [start(otgwd, source, firmware) for firmware, _ in firmwares]
+    time.sleep(RUN_SECONDS)
+    for (firmware, expected), processes in zip(firmwares, runs):
+        log, statistics = stop(*processes)
+        capabilities = [line.split("]: ", 1)[-1] for line in log if "]: Firmware " in line]
+        if capabilities != [expected]:
+            failures.append("%s: expected \"%s\", logged %s" % (firmware, expected, capabilities or "nothing"))
+        for line in log:
+            if "The command code is unknown" in line or "does not know" in line:
+                failures.append("%s: %s" % (firmware, line))
+        print("%s: %s, simulator %s" % (firmware, capabilities, statistics))
+
+    for failure in failures:
+        print("FAIL:", failure)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,152 @@
+// libFuzzer target for the receive path of the protocol core: read_available(), parse_line(),
+// parse_command_response(), parse_summary() and the transaction handling, fed through a mock UART.
+//
+// The first byte of the input selects the configuration, the rest is what the gateway "sent". The
+// target fails on memory errors and undefined behaviour (through the sanitizers) and when the input
+// is not consumed within a bounded number of loops, as the device would stall on it.
+//
+// Built with clang as otgw_fuzz, see CMakeLists.txt. With OTGW_FUZZ_STANDALONE it gets a main that
+// runs the files or directories given as arguments once, which is how ctest replays tests/corpus.
+
+#include "otgw_core.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+namespace esphome {
+namespace otgw {
+
+static uint64_t fuzz_now = 0;
+
+static uint64_t fuzz_clock() { return fuzz_now; }
+
+class FuzzGateway : public OpenthermGatewayCore {
+ public:
+  FuzzGateway(uint8_t const *data, size_t size) : OpenthermGatewayCore(fuzz_clock), _data(data), _size(size) {}
+
+  bool exhausted() const { return _position == _size; }
+
+ protected:
+  uint8_t const *_data;
+  size_t _size;
+  size_t _position = 0;
+
+  int serial_available() override { return _size - _position; }
+
+  int serial_read() override {
+    if (_position == _size) {
+      return -1;
+    }
+    // About the time a byte takes at 9600 baud
+    fuzz_now++;
+    return _data[_position++];
+  }
+
+  void serial_write(std::string const & /*data*/) override {}
+};
+
+}  // namespace otgw
+}  // namespace esphome
+
+using esphome::otgw::FuzzGateway;
+using esphome::otgw::fuzz_now;
+
+// Configuration bits of the first byte
+enum : uint8_t {
+  FUZZ_SUMMARY = 1 << 0,
+  FUZZ_STATISTICS = 1 << 1,
+  FUZZ_TRACE = 1 << 2,
+  FUZZ_ALTERNATIVES = 1 << 3,
+  FUZZ_REUSE_MASTER_SLOTS = 1 << 4,
+  FUZZ_IGNORE_HEATER_OVERRIDES = 1 << 5,
+  FUZZ_BYTE_BUDGET = 1 << 6,
+  FUZZ_NO_LINE_BUDGET = 1 << 7,
+};
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  uint8_t config = data[0];
+  // Start away from 0 and from the deadlines the core derives from it
+  fuzz_now = 1'000'000 + config;
+
+  FuzzGateway gateway(data + 1, size - 1);
+  for (uint8_t data_type : {0, 3, 17, 25, 26, 28, 56, 116}) {
+    gateway.set_interest(data_type, data_type % 3);
+  }
+  gateway.set_summary_interval(config & FUZZ_SUMMARY ? 1000 : 0);
+  gateway.enable_statistics(config & FUZZ_STATISTICS);
+  gateway.set_trace_size(config & FUZZ_TRACE ? 16 : 0);
+  gateway.use_alternatives(config & FUZZ_ALTERNATIVES);
+  gateway.reuse_master_slots(config & FUZZ_REUSE_MASTER_SLOTS);
+  gateway.ignore_heater_overrides(config & FUZZ_IGNORE_HEATER_OVERRIDES);
+  gateway.set_max_bytes_per_loop(config & FUZZ_BYTE_BUDGET ? 64 : 0);
+  gateway.set_max_lines_per_loop(config & FUZZ_NO_LINE_BUDGET ? 0 : 8);
+  gateway.begin();
+
+  // Every loop handles at least one byte, anything slower is a stall
+  size_t max_loops = size + 16;
+  for (size_t loop = 0; !gateway.exhausted(); ++loop) {
+    if (loop == max_loops) {
+      abort();
+    }
+    gateway.process();
+    fuzz_now += 16;
+  }
+
+  // Let the timeouts run out, e.g. of the last transaction and of pending commands and PM requests
+  for (uint64_t step : {100, 1000, 10'000, 600'000}) {
+    fuzz_now += step;
+    gateway.process();
+  }
+
+  gateway.dump_statistics();
+  gateway.dump_trace();
+  return 0;
+}
+
+#ifdef OTGW_FUZZ_STANDALONE
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static int run_file(std::filesystem::path const &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    fprintf(stderr, "Failed to read %s\n", path.c_str());
+    return 1;
+  }
+  std::vector<uint8_t> input{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  printf("%s: %zu bytes\n", path.c_str(), input.size());
+  return LLVMFuzzerTestOneInput(input.data(), input.size());
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FILE|DIRECTORY...\n", argv[0]);
+    return 1;
+  }
+
+  int result = 0;
+  for (int i = 1; i != argc; ++i) {
+    std::filesystem::path path(argv[i]);
+    if (!std::filesystem::is_directory(path)) {
+      result |= run_file(path);
+      continue;
+    }
+    for (auto const &entry : std::filesystem::directory_iterator(path)) {
+      if (entry.is_regular_file()) {
+        result |= run_file(entry.path());
+      }
+    }
+  }
+  return result;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Regenerates the seed corpus of the receive path fuzzer (tests/fuzz_receive.cpp) in tests/corpus.
+#
+# Every seed is one configuration byte (see FUZZ_* in fuzz_receive.cpp) followed by the serial output
+# of tools/otgw_simulator.py, with the commands written to it piped in, or of a capture in
+# tests/captures played back with --replay.
+set -e
+
+cd "$(dirname "$0")/.."
+simulator=tools/otgw_simulator.py
+corpus=tests/corpus
+mkdir -p "$corpus"
+
+# seed NAME CONFIG COMMANDS SIMULATOR_OPTIONS...
+seed() {
+  name=$1
+  config=$2
+  commands=$3
+  shift 3
+  {
+    printf "\\$(printf '%03o' "$config")"
+    # Keep stdin open until the simulator is done, so all replies make it
+    { printf "$commands"; sleep 3; } | python3 "$simulator" --stdio --speed 100 --seed 1 "$@" 2>/dev/null || true
+  } > "$corpus/$name"
+}
+
+seed traffic 0 'PR=A\r\nPR=B\r\nPR=Q\r\nPR=M\r\nKI=125\r\nAA=125\r\nUI=16\r\nPM=26\r\n' --count 60
+seed noise 6 'PR=A\r\nCS=45.5\r\nXX=1\r\nPM=300\r\n' --count 60 --noise 0.3 --overrun 0.3
+seed summary 1 'PR=A\r\nPS=1\r\nPS=1\r\n' --count 10
+seed alternatives 10 'PR=A\r\nAA=26\r\nAA=116\r\nAA=117\r\nDA=116\r\nDA=200\r\n' --count 60 --unsupported 27,28 --alternatives-size 2
+seed firmware-3 0 'PR=A\r\nPM=26\r\nKI=125\r\nUI=16\r\nC2=40\r\nGW=R\r\n' --count 30 --firmware 3.0
+seed monitor 48 'PR=M\r\nGW=0\r\n' --count 30
+
+for capture in tests/captures/*.trace; do
+  {
+    printf '\004'
+    python3 "$simulator" --stdio --speed 1000 --replay "$capture" < /dev/null 2>/dev/null
+  } > "$corpus/capture-$(basename "$capture" .trace)"
+done
@@ -0,0 +1,328 @@
+// Long running test of the protocol core against a simulated gateway on a virtual clock.
+//
+// Runs weeks of traffic in seconds and fails (exit code 1) when:
+//   - a command was dropped because the command queue was full
+//   - the control setpoint (CS) was not refreshed before the gateway would let it expire
+//   - a data type of interest was not received within twice its interval plus the PM timeout
+//   - the heap keeps growing: the peak of every day has to stay close to that of the first day
+//   - the measured boiler response time is off by more than the resolution, also after stalls
+//   - lines were counted as dropped, the simulated line noise adds lines but never loses any. Every
+//     few minutes the loop is blocked for seconds, which must not split transactions either.
+//
+// Usage: otgw_soak [--days DAYS] [--seed SEED] [--noise PROBABILITY] [--overrun PROBABILITY]
+
+#include "otgw_core.h"
+#include "simulated_gateway.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <getopt.h>
+#include <malloc.h>
+#include <map>
+#include <new>
+#include <queue>
+
+///// Heap accounting, every allocation of the process goes through these /////
+
+static size_t heap_live = 0;
+static size_t heap_peak = 0;
+
+void *operator new(size_t size) {
+  void *pointer = malloc(size == 0 ? 1 : size);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  heap_live += malloc_usable_size(pointer);
+  heap_peak = std::max(heap_peak, heap_live);
+  return pointer;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *pointer) noexcept {
+  if (pointer != nullptr) {
+    heap_live -= malloc_usable_size(pointer);
+    free(pointer);
+  }
+}
+
+void operator delete[](void *pointer) noexcept { operator delete(pointer); }
+void operator delete(void *pointer, size_t) noexcept { operator delete(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { operator delete(pointer); }
+
+namespace esphome {
+namespace otgw {
+
+static uint64_t virtual_now = 0;
+
+static uint64_t virtual_clock() { return virtual_now; }
+
+class SoakGateway : public OpenthermGatewayCore {
+ public:
+  explicit SoakGateway(testing::SimulatedGateway &simulator) : OpenthermGatewayCore(virtual_clock), _simulator(simulator) {}
+
+  // The gateway drops the CS override when it is not repeated within a minute
+  static constexpr uint64_t CS_EXPIRY = 60'000;
+  // Same as the heating circuits of the component
+  static constexpr uint64_t CS_REFRESH_INTERVAL = 50'000;
+  static constexpr uint16_t RESOLUTION = RESPONSE_TIME_RESOLUTION;
+
+  // Lines written by the simulated gateway, in the order they appear on the serial line
+  void schedule(uint64_t time, std::string const &line) { _lines.push(ScheduledLine{time, _sequence++, line}); }
+
+  Metrics const &metrics() const { return _metrics; }
+  uint64_t max_cs_gap() const { return _max_cs_gap; }
+  uint64_t time_last_cs_reply() const { return _time_last_cs_reply; }
+  std::map<uint8_t, uint64_t> const &time_last_received() const { return _time_last_received; }
+
+ protected:
+  struct ScheduledLine {
+    uint64_t time;
+    uint64_t sequence;
+    std::string text;
+
+    bool operator>(ScheduledLine const &other) const {
+      return time != other.time ? time > other.time : sequence > other.sequence;
+    }
+  };
+
+  testing::SimulatedGateway &_simulator;
+  std::priority_queue<ScheduledLine, std::vector<ScheduledLine>, std::greater<>> _lines;
+  uint64_t _sequence = 0;
+  std::deque<char> _received;
+
+  uint64_t _time_cs_sent = 0;
+  uint64_t _time_last_cs_reply = 0;
+  uint64_t _max_cs_gap = 0;
+  std::map<uint8_t, uint64_t> _time_last_received;
+
+  int serial_available() override {
+    while (!_lines.empty() && _lines.top().time <= virtual_now) {
+      auto const &line = _lines.top().text;
+      _received.insert(_received.end(), line.begin(), line.end());
+      _received.push_back('\r');
+      _received.push_back('\n');
+      _lines.pop();
+    }
+    return _received.size();
+  }
+
+  int serial_read() override {
+    if (serial_available() == 0) {
+      return -1;
+    }
+    char c = _received.front();
+    _received.pop_front();
+    return static_cast<unsigned char>(c);
+  }
+
+  void serial_write(std::string const &data) override {
+    _simulator.command(virtual_now, data, [this](uint64_t time, std::string const &line) { schedule(time, line); });
+  }
+
+  bool handle_slave_response(uint8_t data_type, uint16_t /*data*/) override {
+    _time_last_received[data_type] = virtual_now;
+    return true;
+  }
+
+  bool handle_gateway_response(uint8_t data_type, uint16_t /*data*/) override {
+    _time_last_received[data_type] = virtual_now;
+    return true;
+  }
+
+  void handle_command_reply(std::string const &command_code, std::string const & /*line*/) override {
+    if (command_code != "CS") {
+      return;
+    }
+    if (_time_last_cs_reply != 0) {
+      _max_cs_gap = std::max(_max_cs_gap, virtual_now - _time_last_cs_reply);
+    }
+    _time_last_cs_reply = virtual_now;
+  }
+
+  // Refreshes the control setpoint like a heating circuit of the component does
+  void handle_idle() override {
+    if (virtual_now < idle_deadline()) {
+      return;
+    }
+    if (queue_command("CS", "45.00")) {
+      _time_cs_sent = virtual_now;
+    }
+  }
+
+  uint64_t idle_deadline() override { return _time_cs_sent == 0 ? 0 : _time_cs_sent + CS_REFRESH_INTERVAL; }
+};
+
+}  // namespace otgw
+}  // namespace esphome
+
+using esphome::otgw::SoakGateway;
+using esphome::otgw::testing::SimulatedGateway;
+using esphome::otgw::virtual_now;
+
+// ESPHome runs the loop of the component about every 16 ms
+static constexpr uint64_t LOOP_INTERVAL = 16;
+static constexpr uint64_t TRANSACTION_INTERVAL = 1000;
+static constexpr uint64_t DAY = 24 * 3600 * 1000ull;
+// Data types are only checked once the initialization is done
+static constexpr uint64_t WARM_UP = 10 * 60 * 1000;
+// The PM timeout of the core, a PM that is not answered in time is given up on
+static constexpr uint64_t REQUEST_TIMEOUT = 5 * 60 * 1000;
+// The loop is blocked this long every interval, e.g. by a slow component or a reconnect
+static constexpr uint64_t STALL_INTERVAL = 7 * 60 * 1000 + 123;
+static constexpr uint64_t STALL_DURATION = 3000;
+// Growth of the daily heap peak that is still accepted, e.g. for containers that reach their final
+// capacity a bit later
+static constexpr size_t HEAP_SLACK = 4096;
+
+// Data types of interest with their interval in minutes. Some are requested by the thermostat, the
+// others have to be requested with PM or the alternatives table.
+static const std::map<uint8_t, uint16_t> INTERESTS{
+  {5, 5}, {17, 1}, {18, 5}, {25, 1}, {26, 1}, {27, 5}, {28, 1}, {56, 10}, {57, 10}, {116, 15}, {120, 15},
+};
+
+int main(int argc, char **argv) {
+  unsigned long days = 30;
+  SimulatedGateway::Options options;
+  // Without the version data types, which thermostats only request at startup. The core detects the
+  // end of the initialization from the gateway requesting the slave version in the slot of another.
+  options.ids = {{0, 4}, {1, 2}, {25, 1}, {28, 1}, {17, 1}, {16, 1}, {24, 1}, {3, 1}, {56, 1}, {57, 1}, {27, 1}, {14, 1}};
+  options.noise = 0.01;
+  options.overrun = 0.01;
+
+  static option const long_options[] = {
+    {"days", required_argument, nullptr, 'd'},
+    {"seed", required_argument, nullptr, 's'},
+    {"noise", required_argument, nullptr, 'n'},
+    {"overrun", required_argument, nullptr, 'o'},
+    {nullptr, 0, nullptr, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 'd':
+        days = strtoul(optarg, nullptr, 10);
+        break;
+      case 's':
+        options.seed = strtoul(optarg, nullptr, 10);
+        break;
+      case 'n':
+        options.noise = strtod(optarg, nullptr);
+        break;
+      case 'o':
+        options.overrun = strtod(optarg, nullptr);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [--days DAYS] [--seed SEED] [--noise P] [--overrun P]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  SimulatedGateway simulator(options);
+  SoakGateway gateway(simulator);
+  for (auto const &interest : INTERESTS) {
+    gateway.set_interest(interest.first, interest.second);
+  }
+  gateway.enable_statistics(true);
+  gateway.set_trace_size(64);
+  gateway.begin();
+
+  bool failed = false;
+  auto fail = [&failed](char const *format, auto... arguments) {
+    printf("FAIL at %.3f h: ", virtual_now / 3'600'000.0);
+    printf(format, arguments...);
+    printf("\n");
+    failed = true;
+  };
+
+  uint64_t end = days * DAY;
+  uint64_t next_transaction = TRANSACTION_INTERVAL;
+  uint64_t next_day = DAY;
+  uint64_t next_stall = STALL_INTERVAL;
+  uint64_t last_staleness_check = 0;
+  size_t first_day_peak = 0;
+  std::map<uint8_t, uint64_t> max_age;
+
+  while (virtual_now < end && !failed) {
+    // Like the loop of ESPHome, process() returns right away when there is nothing to do
+    virtual_now += LOOP_INTERVAL;
+
+    while (next_transaction <= virtual_now) {
+      simulator.transaction(next_transaction, [&gateway](uint64_t time, std::string const &line) {
+        gateway.schedule(time, line);
+      });
+      // The thermostat does not keep exact time either
+      next_transaction += TRANSACTION_INTERVAL - 50 + next_transaction % 97;
+    }
+
+    if (virtual_now >= next_stall) {
+      // The lines received in the meantime pile up in the UART
+      virtual_now += STALL_DURATION;
+      next_stall += STALL_INTERVAL;
+      continue;
+    }
+
+    gateway.process();
+
+    if (gateway.metrics().dropped_commands != 0) {
+      fail("%" PRIu32 " commands were dropped because the queue was full", gateway.metrics().dropped_commands);
+    }
+    if (gateway.metrics().dropped_lines != 0 || gateway.metrics().transaction_mismatches != 0) {
+      fail("%" PRIu32 " lines were dropped and %" PRIu32 " transactions mismatched", gateway.metrics().dropped_lines,
+           gateway.metrics().transaction_mismatches);
+    }
+    if (gateway.metrics().boiler_response_time_max > SimulatedGateway::MAX_RESPONSE_TIME + SoakGateway::RESOLUTION) {
+      fail("measured a boiler response time of %u ms", gateway.metrics().boiler_response_time_max);
+    }
+    uint64_t cs_age = virtual_now - gateway.time_last_cs_reply();
+    if (gateway.max_cs_gap() > SoakGateway::CS_EXPIRY || (virtual_now > WARM_UP && cs_age > SoakGateway::CS_EXPIRY)) {
+      fail("CS was not refreshed for %" PRIu64 " ms", std::max(gateway.max_cs_gap(), cs_age));
+    }
+
+    if (virtual_now > WARM_UP && virtual_now - last_staleness_check >= 1000) {
+      last_staleness_check = virtual_now;
+      for (auto const &interest : INTERESTS) {
+        auto received = gateway.time_last_received().find(interest.first);
+        uint64_t age = virtual_now - (received == gateway.time_last_received().end() ? 0 : received->second);
+        max_age[interest.first] = std::max(max_age[interest.first], age);
+        uint64_t bound = 2 * interest.second * 60'000ull + REQUEST_TIMEOUT;
+        if (age > bound) {
+          fail("data type %u was not received for %" PRIu64 " s (bound %" PRIu64 " s)", interest.first, age / 1000,
+               bound / 1000);
+        }
+      }
+    }
+
+    if (virtual_now >= next_day) {
+      unsigned day = next_day / DAY;
+      printf("day %3u: heap live %zu peak %zu, %" PRIu32 " transactions, %" PRIu32 " commands\n", day, heap_live,
+             heap_peak, simulator.transactions(), simulator.commands());
+      if (day == 1) {
+        first_day_peak = heap_peak;
+      } else if (heap_peak > first_day_peak + HEAP_SLACK) {
+        fail("heap peak of day %u (%zu) exceeds that of day 1 (%zu)", day, heap_peak, first_day_peak);
+      }
+      heap_peak = heap_live;
+      next_day += DAY;
+    }
+  }
+
+  auto const &metrics = gateway.metrics();
+  printf("frames T%" PRIu32 " R%" PRIu32 " B%" PRIu32 " A%" PRIu32 ", parse errors %" PRIu32 ", mismatches %" PRIu32
+         ", dropped lines %" PRIu32 ", overruns %" PRIu32 ", queue high water mark %u\n",
+         metrics.frames[0], metrics.frames[1], metrics.frames[2], metrics.frames[3], metrics.parse_errors,
+         metrics.transaction_mismatches, metrics.dropped_lines, metrics.overrun_errors,
+         metrics.command_queue_high_water_mark);
+  printf("PM issued %" PRIu32 " fulfilled %" PRIu32 " timed out %" PRIu32 ", max CS gap %" PRIu64 " ms\n",
+         metrics.priority_requests_issued, metrics.priority_requests_fulfilled, metrics.priority_requests_timed_out,
+         gateway.max_cs_gap());
+  printf("%u boiler response times, max %u ms\n", metrics.boiler_responses, metrics.boiler_response_time_max);
+  for (auto const &age : max_age) {
+    printf("data type %3u: max age %" PRIu64 " s\n", age.first, age.second / 1000);
+  }
+  printf(failed ? "FAILED\n" : "PASSED\n");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""Replays the captures in tests/captures through otgwd --replay.
+
+Checks that values are published, that the capture shifted across the 32 bit wrap of the trace
+timestamps (wrap.trace) gives the same values as the original (simulator.trace), and that the
+frame trace dumped at the end is in chronological order.
+
+Usage: replay_capture.py OTGWD CAPTURE_DIRECTORY
+"""
+
+import os
+import re
+import subprocess
+import sys
+
+IDS = "0,25:1,26:1,28:1,18:5,116:15"
+TRACE_RECORD = re.compile(r"^\[I\]\[otgw\]: +(\d+) ")
+
+
+def replay(otgwd, capture):
+    result = subprocess.run([otgwd, "--ids", IDS, "--trace", "400", "--replay", capture],
+                            capture_output=True, text=True, timeout=60, check=True)
+    values = [line.split(" ", 1) for line in result.stdout.splitlines()]
+    trace = [int(match.group(1)) for match in map(TRACE_RECORD.match, result.stderr.splitlines()) if match]
+    return values, trace
+
+
+def main():
+    otgwd, captures = sys.argv[1:3]
+    failures = []
+
+    values, trace = replay(otgwd, os.path.join(captures, "simulator.trace"))
+    wrapped_values, wrapped_trace = replay(otgwd, os.path.join(captures, "wrap.trace"))
+
+    if not any(value[1].startswith("B 25 ") for value in values):
+        failures.append("no values of data type 25 were published")
+    if [value[1] for value in values] != [value[1] for value in wrapped_values]:
+        failures.append("the wrapped capture published different values")
+    times = [int(value[0]) for value in wrapped_values]
+    if times != sorted(times):
+        failures.append("the values of the wrapped capture are not in chronological order")
+
+    for name, records in (("simulator", trace), ("wrap", wrapped_trace)):
+        if not records:
+            failures.append("%s: the frame trace is empty" % name)
+        # Timestamps are 32 bit, later records are less than half the range ahead
+        for previous, current in zip(records, records[1:]):
+            if (current - previous) % 2**32 >= 2**31:
+                failures.append("%s: trace record %d follows %d" % (name, current, previous))
+                break
+
+    for failure in failures:
+        print("FAIL:", failure)
+    print("%d values, %d trace records" % (len(values), len(trace)))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
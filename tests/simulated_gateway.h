@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace esphome {
+namespace otgw {
+namespace testing {
+
+// Stand-in for the PIC of the gateway for harnesses that run on a virtual clock, the C++ counterpart
+// of tools/otgw_simulator.py. A thermostat cycles through a weighted mix of data types, the boiler
+// answers with plausible values and the gateway substitutes PM requests and alternatives in the
+// slots of unknown data types, and replies to the serial commands.
+//
+// Lines are handed to the emit callback together with the time they appear on the serial line.
+class SimulatedGateway {
+ public:
+  using Emit = std::function<void(uint64_t time, std::string const &line)>;
+
+  struct Options {
+    // Data types requested by the thermostat, with a weight
+    std::vector<std::pair<uint8_t, uint8_t>> ids{
+      {0, 4}, {1, 2}, {25, 1}, {28, 1}, {17, 1}, {16, 1}, {24, 1}, {3, 1}, {56, 1}, {57, 1}, {27, 1}, {125, 1},
+      {124, 1}, {14, 1},
+    };
+    // Data types the boiler answers with UNKNOWN-DATAID
+    std::set<uint8_t> unsupported;
+    size_t alternatives_size = 32;
+    // Probability of line noise per transaction and of an OE reply per command
+    double noise = 0;
+    double overrun = 0;
+    uint32_t seed = 1;
+  };
+
+  // Time the boiler takes to answer, in ms
+  static constexpr uint32_t MIN_RESPONSE_TIME = 40;
+  static constexpr uint32_t MAX_RESPONSE_TIME = 240;
+
+  explicit SimulatedGateway(Options options) : _options(std::move(options)), _random(_options.seed) {
+    for (auto const &id : _options.ids) {
+      _schedule.insert(_schedule.end(), id.second, id.first);
+    }
+  }
+
+  // Writes the lines of one transaction starting at time now, they take up to about 300 ms
+  void transaction(uint64_t now, Emit const &emit) {
+    _transactions++;
+    if (_options.noise != 0 && uniform() < _options.noise) {
+      write_noise(now, emit);
+    }
+
+    uint8_t data_type = _schedule[_transactions % _schedule.size()];
+    bool write = WRITE_IDS.count(data_type) != 0;
+    uint8_t message_type = write ? WRITE_DATA : READ_DATA;
+    uint16_t data = write ? thermostat_value(data_type, now) : (data_type == 0 ? 0x0300 : 0);
+    emit(now, line('T', frame(message_type, data_type, data)));
+
+    // The boiler has to answer within 800 ms, most take a lot less
+    uint64_t response = now + MIN_RESPONSE_TIME + _random() % (MAX_RESPONSE_TIME - MIN_RESPONSE_TIME);
+    if (_unknown.count(data_type) || _options.unsupported.count(data_type)) {
+      auto replacement = substitute();
+      if (replacement) {
+        emit(now + 5, line('R', frame(READ_DATA, *replacement, 0)));
+        emit(response, line('B', boiler_response(READ_DATA, *replacement, 0, now)));
+        emit(response + 5, line('A', frame(UNKNOWN_DATAID, data_type, data)));
+        return;
+      }
+      if (_unknown.count(data_type)) {
+        emit(now + 5, line('A', frame(UNKNOWN_DATAID, data_type, data)));
+        return;
+      }
+    }
+
+    auto override_value = std::find_if(_overrides.begin(), _overrides.end(), [data_type](auto const &item) {
+      return item.first == data_type;
+    });
+    if (override_value != _overrides.end() && write) {
+      // The gateway replaces the value sent by the thermostat
+      emit(now + 5, line('R', frame(WRITE_DATA, data_type, override_value->second)));
+      emit(response, line('B', boiler_response(WRITE_DATA, data_type, override_value->second, now)));
+      emit(response + 5, line('A', frame(WRITE_ACK, data_type, data)));
+      return;
+    }
+
+    emit(response, line('B', boiler_response(message_type, data_type, data, now)));
+    if (override_value != _overrides.end()) {
+      emit(response + 5, line('A', frame(READ_ACK, data_type, override_value->second)));
+    }
+  }
+
+  // Handles a command written by the component, the reply follows after a short delay
+  void command(uint64_t now, std::string const &command, Emit const &emit) {
+    _commands++;
+    uint64_t time = now + 20;
+    std::string text = command.substr(0, command.find_first_of("\r\n"));
+    if (_options.overrun != 0 && uniform() < _options.overrun) {
+      return emit(time, "OE");
+    }
+    if (text.size() < 4 || text[2] != '=') {
+      return emit(time, "SE");
+    }
+
+    std::string code = text.substr(0, 2);
+    std::string value = text.substr(3);
+    auto reply = [&](std::string const &result) { emit(time, code + ": " + result); };
+
+    if (code == "GW" && value == "R") {
+      reset(time, emit);
+      return;
+    }
+    if (code == "PR") {
+      if (value == "A")
+        return reply("A=OpenTherm Gateway 5.4");
+      if (value == "B")
+        return reply("B=17:42 12-01-2022");
+      if (value == "Q")
+        return reply("Q=" + std::string(1, _reset_cause));
+      if (value == "M")
+        return reply("M=G");
+      return emit(time, "BV");
+    }
+    if (code == "PM" || code == "KI" || code == "UI" || code == "AA" || code == "DA") {
+      char *end;
+      unsigned long data_type = strtoul(value.c_str(), &end, 10);
+      if (end == value.c_str() || *end != '\0' || data_type > 255) {
+        return emit(time, "BV");
+      }
+      if (code == "PM") {
+        // There is a single priority message, a new one replaces the pending one
+        _priority = data_type;
+      } else if (code == "KI") {
+        _unknown.erase(data_type);
+      } else if (code == "UI") {
+        _unknown.insert(data_type);
+      } else if (code == "AA") {
+        if (_alternatives.size() == _options.alternatives_size) {
+          return emit(time, "NS");
+        }
+        _alternatives.push_back(data_type);
+      } else {
+        auto it = std::find(_alternatives.begin(), _alternatives.end(), data_type);
+        if (it == _alternatives.end()) {
+          return emit(time, "NF");
+        }
+        _alternatives.erase(it);
+      }
+      return reply(std::to_string(data_type));
+    }
+    if (code == "CS" || code == "C2" || code == "SW" || code == "TT" || code == "TC" || code == "OT") {
+      char *end;
+      float temperature = strtof(value.c_str(), &end);
+      if (end == value.c_str() || temperature < -40 || temperature > 100) {
+        return emit(time, "OR");
+      }
+      uint8_t target = code == "CS" ? 1 : code == "C2" ? 8 : code == "SW" ? 56 : code == "OT" ? 27 : 9;
+      _overrides.erase(std::remove_if(_overrides.begin(), _overrides.end(), [target](auto const &item) {
+        return item.first == target;
+      }), _overrides.end());
+      if (temperature != 0) {
+        _overrides.emplace_back(target, f88(temperature));
+      }
+      char formatted[16];
+      snprintf(formatted, sizeof(formatted), "%.2f", temperature);
+      return reply(formatted);
+    }
+    if (code == "PS" || code == "CH" || code == "H2" || code == "HW" || code == "BW" || code == "RR" ||
+        code == "SC" || code == "DP" || code == "GW") {
+      return reply(value);
+    }
+    emit(time, "NG");
+  }
+
+  // A restart of the PIC, e.g. by its watchdog. The overrides and a pending PM are forgotten.
+  void reset(uint64_t now, Emit const &emit) {
+    _reset_cause = 'C';
+    // The alternatives table and the unknown data types are kept in EEPROM
+    _priority.reset();
+    _overrides.clear();
+    emit(now, "OpenTherm Gateway 5.4");
+  }
+
+  // Value the gateway currently sends to the boiler instead of the one of the thermostat
+  bool has_override(uint8_t data_type) const {
+    return std::any_of(_overrides.begin(), _overrides.end(), [data_type](auto const &item) {
+      return item.first == data_type;
+    });
+  }
+
+  uint32_t transactions() const { return _transactions; }
+  uint32_t commands() const { return _commands; }
+
+  static uint16_t f88(float value) { return static_cast<uint16_t>(static_cast<int32_t>(std::lround(value * 256))); }
+
+  static uint32_t frame(uint8_t message_type, uint8_t data_type, uint16_t data) {
+    uint32_t message = (uint32_t{message_type} << 28) | (uint32_t{data_type} << 16) | data;
+    if (__builtin_popcount(message) % 2) {
+      message |= 1u << 31;
+    }
+    return message;
+  }
+
+  static std::string line(char step, uint32_t message) {
+    char text[10];
+    snprintf(text, sizeof(text), "%c%08X", step, static_cast<unsigned>(message));
+    return text;
+  }
+
+ protected:
+  enum : uint8_t {
+    READ_DATA = 0,
+    WRITE_DATA = 1,
+    READ_ACK = 4,
+    WRITE_ACK = 5,
+    UNKNOWN_DATAID = 7,
+  };
+  // Data types sent as WRITE_DATA by the thermostat, everything else is read
+  inline static const std::set<uint8_t> WRITE_IDS{1, 2, 4, 7, 8, 14, 16, 23, 24, 37, 124, 126};
+
+  Options _options;
+  std::mt19937 _random;
+  std::vector<uint8_t> _schedule;
+  std::set<uint8_t> _unknown;
+  std::vector<uint8_t> _alternatives;
+  size_t _alternative_index = 0;
+  std::optional<uint8_t> _priority;
+  std::vector<std::pair<uint8_t, uint16_t>> _overrides;
+  char _reset_cause = 'P';
+  uint32_t _transactions = 0;
+  uint32_t _commands = 0;
+
+  double uniform() { return std::uniform_real_distribution<double>(0, 1)(_random); }
+
+  std::optional<uint8_t> substitute() {
+    if (_priority) {
+      uint8_t data_type = *_priority;
+      _priority.reset();
+      return data_type;
+    }
+    if (!_alternatives.empty()) {
+      _alternative_index = (_alternative_index + 1) % _alternatives.size();
+      return _alternatives[_alternative_index];
+    }
+    return std::nullopt;
+  }
+
+  uint16_t thermostat_value(uint8_t data_type, uint64_t now) const {
+    switch (data_type) {
+      case 1:
+        return f88(45);
+      case 14:
+        return f88(100);
+      case 16:
+        return f88(20);
+      case 24:
+      case 37:
+        return f88(19.5f + 0.5f * std::sin(now / 600'000.0f));
+      case 124:
+        return f88(2.2f);
+      default:
+        return 0;
+    }
+  }
+
+  std::optional<uint16_t> boiler_value(uint8_t data_type, uint64_t now) const {
+    float wave = std::sin(now / 300'000.0f);
+    switch (data_type) {
+      case 0:
+        // CH enabled, flame on most of the time
+        return 0x0100 | (wave > -0.5f ? 0x0A : 0x00);
+      case 3:
+        return 0x0100;
+      case 5:
+        return 0;
+      case 15:
+        return (24 << 8) | 20;
+      case 17:
+        return f88(std::max(0.0f, 40 + 30 * wave));
+      case 18:
+        return f88(1.6f + 0.05f * wave);
+      case 19:
+        return f88(0);
+      case 25:
+      case 31:
+        return f88(45 + 10 * wave);
+      case 26:
+      case 32:
+        return f88(52 + 2 * wave);
+      case 27:
+        return f88(8 + 4 * wave);
+      case 28:
+        return f88(38 + 8 * wave);
+      case 48:
+        return (65 << 8) | 40;
+      case 49:
+        return (90 << 8) | 20;
+      case 56:
+        return f88(55);
+      case 57:
+        return f88(80);
+      case 125:
+        return f88(2.2f);
+      case 127:
+        return (1 << 8) | 3;
+      default:
+        if (data_type >= 113 && data_type <= 123) {
+          // Counters, they increase about once an hour
+          return static_cast<uint16_t>(1200 + data_type + now / 3'600'000);
+        }
+        return std::nullopt;
+    }
+  }
+
+  uint32_t boiler_response(uint8_t message_type, uint8_t data_type, uint16_t data, uint64_t now) const {
+    if (_options.unsupported.count(data_type)) {
+      return frame(UNKNOWN_DATAID, data_type, data);
+    }
+    if (message_type == WRITE_DATA) {
+      return frame(WRITE_ACK, data_type, data);
+    }
+    auto value = boiler_value(data_type, now);
+    if (!value) {
+      return frame(UNKNOWN_DATAID, data_type, data);
+    }
+    return frame(READ_ACK, data_type, *value);
+  }
+
+  void write_noise(uint64_t now, Emit const &emit) {
+    switch (_random() % 4) {
+      case 0: {
+        // Truncated frame
+        char text[8];
+        snprintf(text, sizeof(text), "%c%05X", "TBRA"[_random() % 4], static_cast<unsigned>(_random() % (1 << 20)));
+        emit(now, text);
+        break;
+      }
+      case 1: {
+        // Random printable bytes
+        std::string text;
+        for (uint32_t i = _random() % 40; i != 0; --i) {
+          text += static_cast<char>(' ' + _random() % 95);
+        }
+        emit(now, text);
+        break;
+      }
+      case 2:
+        // Something that looks like a command reply
+        emit(now, std::string(_random() % 2 ? "PR:" : "XX:") + std::string(_random() % 3, '?'));
+        break;
+      default:
+        // Overlong line
+        emit(now, std::string(130 + _random() % 200, 'T'));
+        break;
+    }
+  }
+};
+
+}  // namespace testing
+}  // namespace otgw
+}  // namespace esphome
@@ -0,0 +1,169 @@
+// Tests of the lock-free ring between the reader task and loop() (components/otgw/spsc_ring.h).
+//
+// The edges are checked on one thread: empty, full, and the indices wrapping at the overflow of
+// uint32_t. Then one producer and one consumer thread pass a long sequence through a small ring
+// that starts just before the wrap, the consumer checks that every item arrives once, in order and
+// complete. Built with -fsanitize=thread, which also reports any data race on the items.
+//
+// Usage: otgw_spsc_ring [--items N]
+
+#include "spsc_ring.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+namespace esphome {
+namespace otgw {
+
+// Like ReceivedLine in otgw.h, bigger than an atomic store so a torn copy would show
+struct TestItem {
+  uint32_t sequence;
+  uint32_t check[7];
+};
+
+static TestItem make_item(uint32_t sequence) {
+  TestItem item{sequence, {}};
+  for (uint32_t i = 0; i != 7; ++i) {
+    item.check[i] = sequence * 2654435761u + i;
+  }
+  return item;
+}
+
+static bool is_complete(TestItem const &item) {
+  TestItem expected = make_item(item.sequence);
+  return std::memcmp(&item, &expected, sizeof(item)) == 0;
+}
+
+template<size_t SIZE>
+class TestRing : public SpscRing<TestItem, SIZE> {
+ public:
+  // Only before the ring is shared
+  void start_at(uint32_t index) {
+    this->_head.store(index);
+    this->_tail.store(index);
+  }
+};
+
+}  // namespace otgw
+}  // namespace esphome
+
+using esphome::otgw::TestItem;
+using esphome::otgw::TestRing;
+using esphome::otgw::is_complete;
+using esphome::otgw::make_item;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (false)
+
+// Fills and drains the ring a few times, starting at START so the indices wrap on the way
+template<size_t SIZE>
+static void test_edges(uint32_t start) {
+  TestRing<SIZE> ring;
+  ring.start_at(start);
+  TestItem item;
+
+  uint32_t sequence = 0;
+  for (uint32_t round = 0; round != 3; ++round) {
+    CHECK(ring.size() == 0);
+    CHECK(!ring.pop(item));
+
+    for (size_t i = 0; i != SIZE; ++i) {
+      CHECK(ring.push(make_item(sequence + i)));
+      CHECK(ring.size() == i + 1);
+    }
+    CHECK(!ring.push(make_item(UINT32_MAX)));
+    CHECK(ring.size() == SIZE);
+
+    // One out makes room for exactly one
+    CHECK(ring.pop(item) && item.sequence == sequence && is_complete(item));
+    CHECK(ring.push(make_item(sequence + SIZE)));
+    CHECK(!ring.push(make_item(UINT32_MAX)));
+
+    for (size_t i = 1; i != SIZE + 1; ++i) {
+      CHECK(ring.pop(item) && item.sequence == sequence + i && is_complete(item));
+    }
+    CHECK(!ring.pop(item));
+    CHECK(ring.size() == 0);
+    sequence += SIZE + 1;
+  }
+}
+
+// One producer and one consumer thread, the ring is full and empty many times along the way
+static void test_threads(uint32_t start, uint32_t items) {
+  TestRing<8> ring;
+  ring.start_at(start);
+
+  std::thread producer([&ring, items]() {
+    for (uint32_t sequence = 0; sequence != items;) {
+      if (ring.push(make_item(sequence))) {
+        sequence++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  uint32_t expected = 0;
+  uint32_t out_of_order = 0;
+  uint32_t torn = 0;
+  uint32_t max_size = 0;
+  while (expected != items) {
+    size_t size = ring.size();
+    max_size = std::max<uint32_t>(max_size, size);
+    CHECK(size <= 8);
+
+    TestItem item;
+    if (!ring.pop(item)) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (item.sequence != expected) {
+      out_of_order++;
+    }
+    if (!is_complete(item)) {
+      torn++;
+    }
+    expected = item.sequence + 1;
+  }
+  producer.join();
+
+  TestItem item;
+  CHECK(!ring.pop(item));
+  CHECK(ring.size() == 0);
+  CHECK(out_of_order == 0);
+  CHECK(torn == 0);
+  printf("%u items from %u, %u out of order, %u torn, at most %u queued\n", items, start, out_of_order, torn,
+         max_size);
+}
+
+int main(int argc, char **argv) {
+  uint32_t items = 1'000'000;
+  if (argc == 3 && std::strcmp(argv[1], "--items") == 0) {
+    items = std::strtoul(argv[2], nullptr, 10);
+  } else if (argc != 1) {
+    fprintf(stderr, "Usage: %s [--items N]\n", argv[0]);
+    return 1;
+  }
+
+  test_edges<1>(0);
+  test_edges<4>(0);
+  test_edges<4>(UINT32_MAX - 5);
+  test_edges<64>(UINT32_MAX - 100);
+
+  test_threads(0, items);
+  test_threads(UINT32_MAX - items / 2, items);
+
+  printf(failures == 0 ? "PASSED\n" : "FAILED\n");
+  return failures == 0 ? 0 : 1;
+}
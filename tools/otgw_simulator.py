@@ -0,0 +1,487 @@
+#!/usr/bin/env python3
+"""Software stand-in for the PIC of a Nodoshop Opentherm Gateway.
+
+Emulates the serial output of a gateway that sits between a thermostat and a
+boiler: a T/R/B/A transaction roughly every second and replies to the serial
+commands the component sends. The simulator can be attached to a
+pseudo-terminal (default) or to stdin/stdout, which allows it to be used as a
+mock UART by piping it into another process.
+
+Example:
+    ./otgw_simulator.py --ids 0:4,1,25,28,17,16,24,56 --unsupported 27 --noise 0.01
+"""
+
+import argparse
+import math
+import os
+import random
+import re
+import select
+import sys
+import time
+import tty
+
+# Message types, see Transaction::MessageType in otgw_core.h
+READ_DATA = 0
+WRITE_DATA = 1
+READ_ACK = 4
+WRITE_ACK = 5
+DATA_INVALID = 6
+UNKNOWN_DATAID = 7
+
+# Data types sent as WRITE_DATA by the thermostat, everything else is read
+WRITE_IDS = {1, 2, 4, 7, 8, 14, 16, 23, 24, 37, 124, 126}
+
+# Maximum number of entries in the alternatives table of the gateway
+ALTERNATIVES_SIZE = 32
+
+FIRMWARE_VERSION = "5.4"
+
+# Commands added in later firmware versions, older versions answer them with NG
+COMMANDS_SINCE = {
+    "PM": 4, "KI": 4, "UI": 4,
+    "C2": 5, "H2": 5,
+}
+FIRMWARE_BUILD_DATE = "17:42 12-01-2022"
+
+
+def f88(value):
+    return int(round(value * 256)) & 0xFFFF
+
+
+def frame(message_type, data_id, data):
+    message = ((message_type & 0b111) << 28) | ((data_id & 0xFF) << 16) | (data & 0xFFFF)
+    if bin(message).count("1") % 2:
+        message |= 1 << 31
+    return message
+
+
+class Boiler:
+    """Produces slowly varying but plausible values for the common data types."""
+
+    def __init__(self, unsupported):
+        self.unsupported = set(unsupported)
+        self.start = time.monotonic()
+        self.starts = 1200
+        self.hours = 8000
+        self.writes = {}
+
+    def value(self, data_id, now):
+        t = now - self.start
+        wave = math.sin(t / 300.0)
+        if data_id == 0:
+            # CH enabled, flame on most of the time
+            return 0x0100 | (0x0A if wave > -0.5 else 0x00)
+        if data_id == 3:
+            return 0x0100
+        if data_id == 5:
+            return 0x0000
+        if data_id == 15:
+            return (24 << 8) | 20
+        if data_id == 17:
+            return f88(max(0.0, 40 + 30 * wave))
+        if data_id == 18:
+            return f88(1.6 + 0.05 * wave)
+        if data_id == 19:
+            return f88(0.0)
+        if data_id in (25, 31):
+            return f88(45 + 10 * wave)
+        if data_id in (26, 32):
+            return f88(52 + 2 * wave)
+        if data_id == 27:
+            return f88(8 + 4 * wave)
+        if data_id == 28:
+            return f88(38 + 8 * wave)
+        if data_id == 48:
+            return (65 << 8) | 40
+        if data_id == 49:
+            return (90 << 8) | 20
+        if data_id == 56:
+            return f88(self.writes.get(56, 55.0))
+        if data_id == 57:
+            return f88(80.0)
+        if data_id == 125:
+            return f88(2.2)
+        if data_id == 127:
+            return (1 << 8) | 3
+        if 113 <= data_id <= 119:
+            return (self.starts + data_id) & 0xFFFF
+        if 120 <= data_id <= 123:
+            return (self.hours + data_id) & 0xFFFF
+        return None
+
+    def respond(self, message_type, data_id, data, now):
+        if data_id in self.unsupported:
+            return frame(UNKNOWN_DATAID, data_id, data)
+        if message_type == WRITE_DATA:
+            self.writes[data_id] = data / 256.0
+            return frame(WRITE_ACK, data_id, data)
+        value = self.value(data_id, now)
+        if value is None:
+            return frame(UNKNOWN_DATAID, data_id, data)
+        return frame(READ_ACK, data_id, value)
+
+
+class Thermostat:
+    """Cycles through a weighted mix of data types, like a room thermostat does."""
+
+    def __init__(self, id_mix):
+        self.schedule = []
+        for data_id, weight in id_mix:
+            self.schedule.extend([data_id] * weight)
+        self.index = 0
+        self.room_setpoint = 20.0
+
+    def next_request(self, now):
+        data_id = self.schedule[self.index % len(self.schedule)]
+        self.index += 1
+        if data_id not in WRITE_IDS:
+            return READ_DATA, data_id, 0x0300 if data_id == 0 else 0
+        return WRITE_DATA, data_id, self.write_value(data_id, now)
+
+    def write_value(self, data_id, now):
+        if data_id == 1:
+            return f88(45.0)
+        if data_id == 14:
+            return f88(100.0)
+        if data_id == 16:
+            return f88(self.room_setpoint)
+        if data_id in (24, 37):
+            return f88(19.5 + 0.5 * math.sin(now / 600.0))
+        if data_id == 124:
+            return f88(2.2)
+        return 0
+
+
+class Gateway:
+    def __init__(self, args, out):
+        self.args = args
+        self.out = out
+        self.rng = random.Random(args.seed)
+        self.boiler = Boiler(args.unsupported)
+        self.thermostat = Thermostat(args.ids)
+        self.unknown = set()
+        self.alternatives = []
+        self.alternative_index = 0
+        self.priority = []
+        self.overrides = {}
+        # With PS=1 the gateway stops reporting messages and only prints summaries
+        self.summary = False
+        self.reset_cause = "P"
+        self.command_buffer = b""
+        self.stats = {"transactions": 0, "commands": 0, "errors": 0, "noise": 0}
+
+    ##### Output #####
+
+    def write_line(self, line):
+        self.out(line.encode("ascii") + b"\r\n")
+
+    def write_frame(self, step, message):
+        if not self.summary:
+            self.write_line("%c%08X" % (step, message))
+
+    def write_summary(self, now):
+        boiler = self.boiler
+
+        def flags(data_id):
+            value = boiler.value(data_id, now) or 0
+            return "{:08b}/{:08b}".format(value >> 8, value & 0xFF)
+
+        def pair(data_id):
+            value = boiler.value(data_id, now) or 0
+            return "%d/%d" % (value >> 8, value & 0xFF)
+
+        def f88_value(value):
+            return "%.2f" % ((value - 0x10000 if value & 0x8000 else value) / 256.0)
+
+        def reading(data_id):
+            return f88_value(boiler.value(data_id, now) or 0)
+
+        def written(data_id):
+            return f88_value(self.thermostat.write_value(data_id, now))
+
+        def counter(data_id):
+            return "%d" % (boiler.value(data_id, now) or 0)
+
+        fields = [
+            flags(0), written(1), flags(6), written(14), pair(15), written(16), reading(17), reading(18),
+            written(24), reading(25), reading(26), reading(27), reading(28), pair(48), pair(49), reading(56),
+            reading(57),
+        ] + [counter(data_id) for data_id in range(116, 124)]
+        self.write_line(",".join(fields))
+
+    def write_noise(self):
+        self.stats["noise"] += 1
+        kind = self.rng.randrange(4)
+        if kind == 0:
+            # Truncated frame
+            self.write_line("%c%05X" % (self.rng.choice("TBRA"), self.rng.randrange(1 << 20)))
+        elif kind == 1:
+            # Random bytes, possibly without line end
+            self.out(bytes(self.rng.randrange(256) for _ in range(self.rng.randrange(1, 40))))
+        elif kind == 2:
+            # Something that looks like a command reply
+            self.write_line("%s:%s" % (self.rng.choice(["PR", "XX", "CS"]), "?" * self.rng.randrange(3)))
+        else:
+            # Overlong line
+            self.write_line("T" * self.rng.randrange(130, 200))
+
+    ##### Bus traffic #####
+
+    def substitute(self):
+        if self.priority:
+            return self.priority.pop(0)
+        if self.alternatives:
+            self.alternative_index = (self.alternative_index + 1) % len(self.alternatives)
+            return self.alternatives[self.alternative_index]
+        return None
+
+    def transaction(self, now):
+        self.stats["transactions"] += 1
+        message_type, data_id, data = self.thermostat.next_request(now)
+        self.write_frame("T", frame(message_type, data_id, data))
+
+        if data_id in self.unknown or data_id in self.boiler.unsupported:
+            replacement = self.substitute()
+            if replacement is not None:
+                request = frame(READ_DATA, replacement, 0)
+                self.write_frame("R", request)
+                self.write_frame("B", self.boiler.respond(READ_DATA, replacement, 0, now))
+                self.write_frame("A", frame(UNKNOWN_DATAID, data_id, data))
+                return
+            if data_id in self.unknown:
+                self.write_frame("A", frame(UNKNOWN_DATAID, data_id, data))
+                return
+
+        override = self.overrides.get(data_id)
+        if override is not None and message_type == WRITE_DATA:
+            # The gateway replaces the value sent by the thermostat
+            self.write_frame("R", frame(WRITE_DATA, data_id, override))
+            self.write_frame("B", self.boiler.respond(WRITE_DATA, data_id, override, now))
+            self.write_frame("A", frame(WRITE_ACK, data_id, data))
+            return
+
+        response = self.boiler.respond(message_type, data_id, data, now)
+        self.write_frame("B", response)
+        if override is not None:
+            self.write_frame("A", frame(READ_ACK, data_id, override))
+
+    ##### Commands #####
+
+    def receive(self, data):
+        self.command_buffer += data
+        while b"\r" in self.command_buffer:
+            line, _, self.command_buffer = self.command_buffer.partition(b"\r")
+            line = line.strip(b"\n").decode("ascii", "replace")
+            if line:
+                self.command(line)
+
+    def reply(self, code, value):
+        self.write_line("%s: %s" % (code, value))
+
+    def error(self, code):
+        self.stats["errors"] += 1
+        self.write_line(code)
+
+    def command(self, line):
+        self.stats["commands"] += 1
+        if self.rng.random() < self.args.overrun:
+            return self.error("OE")
+        if len(line) < 4 or line[2] != "=":
+            return self.error("SE")
+
+        code, value = line[:2], line[3:]
+        if int(self.args.firmware.split(".")[0]) < COMMANDS_SINCE.get(code, 0):
+            return self.error("NG")
+        try:
+            if code == "GW":
+                if value == "R":
+                    self.reset_cause = "C"
+                    self.summary = False
+                    # The alternatives table and the unknown data ids are kept in EEPROM
+                    self.overrides.clear()
+                    self.write_line("OpenTherm Gateway " + self.args.firmware)
+                    return
+                return self.reply(code, value)
+            if code == "PR":
+                reports = {"A": "OpenTherm Gateway " + self.args.firmware, "B": FIRMWARE_BUILD_DATE, "Q": self.reset_cause, "M": "G"}
+                if value not in reports:
+                    return self.error("BV")
+                return self.reply(code, "%s=%s" % (value, reports[value]))
+            if code in ("PM", "KI", "UI", "AA", "DA"):
+                data_id = int(value)
+                if not 0 <= data_id <= 255:
+                    return self.error("OR")
+                if code == "PM":
+                    # There is a single priority message, a new one replaces the pending one
+                    self.priority = [data_id]
+                elif code == "KI":
+                    self.unknown.discard(data_id)
+                elif code == "UI":
+                    self.unknown.add(data_id)
+                elif code == "AA":
+                    if len(self.alternatives) == self.args.alternatives_size:
+                        return self.error("NS")
+                    self.alternatives.append(data_id)
+                elif code == "DA":
+                    if data_id not in self.alternatives:
+                        return self.error("NF")
+                    self.alternatives.remove(data_id)
+                return self.reply(code, data_id)
+            if code == "PS":
+                if value not in ("0", "1"):
+                    return self.error("BV")
+                self.summary = value == "1"
+                self.reply(code, value)
+                if self.summary:
+                    self.write_summary(time.monotonic())
+                return
+            if code in ("CS", "C2", "SW", "TT", "TC", "OT"):
+                temperature = float(value)
+                if not -40 <= temperature <= 100:
+                    return self.error("OR")
+                target = {"CS": 1, "C2": 8, "SW": 56, "TT": 9, "TC": 9, "OT": 27}[code]
+                if temperature == 0:
+                    self.overrides.pop(target, None)
+                else:
+                    self.overrides[target] = f88(temperature)
+                return self.reply(code, "%.2f" % temperature)
+            if code in ("CH", "H2", "HW", "BW", "RR", "SC", "DP"):
+                return self.reply(code, value)
+        except ValueError:
+            return self.error("BV")
+        return self.error("NG")
+
+    ##### Main loop #####
+
+    def run(self, read_fd):
+        interval = self.args.interval / self.args.speed
+        next_transaction = time.monotonic()
+        count = 0
+        while self.args.count == 0 or count < self.args.count:
+            timeout = max(0.0, next_transaction - time.monotonic())
+            readable, _, _ = select.select([read_fd], [], [], timeout)
+            if readable:
+                data = os.read(read_fd, 256)
+                if not data:
+                    break
+                self.receive(data)
+                continue
+
+            now = time.monotonic()
+            if self.rng.random() < self.args.noise:
+                self.write_noise()
+            self.transaction(now)
+            count += 1
+            next_transaction += interval * self.rng.uniform(0.9, 1.1)
+
+
+def parse_id_mix(value):
+    mix = []
+    for item in value.split(","):
+        data_id, _, weight = item.partition(":")
+        mix.append((int(data_id), int(weight or 1)))
+    return mix
+
+
+def parse_id_list(value):
+    return [int(item) for item in value.split(",") if item]
+
+
+class Replay:
+    """Plays back a capture made with the dump_trace button of the component.
+
+    Frames and replies of the gateway are written with their original timing (divided by --speed),
+    commands received from the other side are only counted.
+    """
+
+    RECORD = re.compile(r"(\d+) (?:([TRBA][0-9A-Fa-f]{8})\s*$|([<>]) (.*)$)")
+
+    def __init__(self, args, out):
+        self.args = args
+        self.out = out
+        self.records = []
+        epoch = 0
+        previous = None
+        with open(args.replay) as capture:
+            for line in capture:
+                # Allow log prefixes, e.g. when the capture is copied from the ESPHome log
+                match = self.RECORD.search(line)
+                if not match:
+                    continue
+                # The trace has 32 bit timestamps, which wrap after 49 days
+                timestamp = int(match.group(1))
+                if previous is not None and previous - timestamp > 2**31:
+                    epoch += 2**32
+                previous = timestamp
+                timestamp += epoch
+                if match.group(2):
+                    self.records.append((timestamp, match.group(2).upper()))
+                elif match.group(3) == "<":
+                    self.records.append((timestamp, match.group(4).rstrip()))
+        self.stats = {"records": len(self.records), "written": 0, "commands": 0}
+
+    def run(self, read_fd):
+        if not self.records:
+            return
+        read_fds = [read_fd]
+        start = time.monotonic()
+        first = self.records[0][0]
+        for timestamp, line in self.records:
+            due = start + (timestamp - first) / 1000.0 / self.args.speed
+            while True:
+                timeout = due - time.monotonic()
+                if timeout <= 0:
+                    break
+                readable, _, _ = select.select(read_fds, [], [], timeout)
+                if readable:
+                    data = os.read(read_fd, 256)
+                    if not data:
+                        read_fds = []
+                    self.stats["commands"] += data.count(b"\r")
+            self.out(line.encode("ascii") + b"\r\n")
+            self.stats["written"] += 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--ids", type=parse_id_mix, default=parse_id_mix("0:4,1:2,25,28,17,16,24,3,56,57,27,125,124,14"),
+                        help="Data types requested by the thermostat, optionally with a weight (id[:weight],...)")
+    parser.add_argument("--unsupported", type=parse_id_list, default=[],
+                        help="Data types the boiler answers with UNKNOWN-DATAID")
+    parser.add_argument("--interval", type=float, default=1.0, help="Seconds between transactions")
+    parser.add_argument("--speed", type=float, default=1.0, help="Time compression factor")
+    parser.add_argument("--count", type=int, default=0, help="Stop after this many transactions (0 = never)")
+    parser.add_argument("--noise", type=float, default=0.0, help="Probability of line noise per transaction")
+    parser.add_argument("--overrun", type=float, default=0.0, help="Probability of an OE reply per command")
+    parser.add_argument("--alternatives-size", type=int, default=ALTERNATIVES_SIZE,
+                        help="Number of entries in the alternatives table, AA beyond that fails with NS")
+    parser.add_argument("--firmware", default=FIRMWARE_VERSION,
+                        help="Firmware version to report, commands it does not have are answered with NG")
+    parser.add_argument("--seed", type=int, default=None)
+    parser.add_argument("--stdio", action="store_true", help="Use stdin/stdout instead of a pseudo-terminal")
+    parser.add_argument("--replay", metavar="CAPTURE",
+                        help="Play back a capture made with the dump_trace button instead of simulating")
+    args = parser.parse_args()
+
+    if args.stdio:
+        read_fd = sys.stdin.fileno()
+        out = lambda data: (sys.stdout.buffer.write(data), sys.stdout.buffer.flush())
+    else:
+        master, slave = os.openpty()
+        # Without this the pseudo-terminal echoes the frames back to the simulator as commands
+        tty.setraw(slave)
+        print("Simulated gateway available on %s" % os.ttyname(slave), file=sys.stderr)
+        read_fd = master
+        out = lambda data: os.write(master, data)
+
+    gateway = Replay(args, out) if args.replay else Gateway(args, out)
+    try:
+        gateway.run(read_fd)
+    except KeyboardInterrupt:
+        pass
+    print(" ".join("%s=%d" % item for item in gateway.stats.items()), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
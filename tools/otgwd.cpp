@@ -0,0 +1,645 @@
+// Host daemon for an OpenTherm Gateway attached to a Linux machine instead of an ESP.
+//
+// Runs the same protocol core as the ESPHome component against a serial device (or the
+// pseudo-terminal of tools/otgw_simulator.py) and publishes every decoded value to the clients
+// of a local unix socket, one line per value:
+//   <unix time in ms> <T|B|A> <data id> <value as 4 hex digits>
+// T is a value written by the thermostat, B a value read from the boiler and A a value the gateway
+// answered in place of the boiler. PR reports are published as:
+//   <unix time in ms> PR <code> <value>
+//
+// With --replay a capture (the dump of the frame trace) is played back through the core instead, on
+// a clock that follows the timestamps of the capture. The values are then written to stdout with the
+// time of the capture.
+//
+// Build with: cmake --build <dir> --target otgwd
+// Example:    otgwd --ids 0,1,25:1,26:10,28:1 --socket /run/otgwd.sock /dev/ttyUSB0
+//             otgwd --ids 0,1,25:1 --replay capture.txt
+
+#include "otgw_core.h"
+#include "otgw_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <getopt.h>
+#include <map>
+#include <poll.h>
+#include <regex>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace esphome {
+namespace otgw {
+
+static uint64_t monotonic_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+static uint64_t unix_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()
+  ).count();
+}
+
+class OpenthermGatewayDaemon : public OpenthermGatewayCore {
+ public:
+  explicit OpenthermGatewayDaemon(int serial_fd) : OpenthermGatewayCore(monotonic_ms), _serial_fd(serial_fd) {
+    // The kernel buffers the serial port, there is no loop to share with other components
+    set_max_lines_per_loop(0);
+  }
+
+  bool serial_failed() const { return _serial_failed; }
+  bool has_buffered_input() const { return _read_position != _read_length; }
+
+  void add_client(int fd);
+  // Sends pending output, returns false when the client is gone
+  bool flush_client(int fd);
+  void remove_client(int fd);
+  bool client_has_output(int fd) const;
+  std::vector<int> const &clients() const { return _client_fds; }
+
+ protected:
+  // Clients that fall this far behind are disconnected
+  static constexpr size_t MAX_CLIENT_BACKLOG = 16 * 1024;
+
+  int _serial_fd;
+  bool _serial_failed = false;
+  std::array<char, 256> _read_buffer;
+  size_t _read_position = 0;
+  size_t _read_length = 0;
+
+  std::vector<int> _client_fds;
+  std::vector<std::string> _client_output;
+  // The gateway is only queried at startup, so clients connecting later get the last reports
+  std::map<char, std::string> _print_reports;
+
+  int serial_available() override;
+  int serial_read() override;
+  void serial_write(std::string const &data) override;
+
+  bool handle_slave_response(uint8_t data_type, uint16_t data) override;
+  bool handle_master_request(uint8_t data_type, uint16_t data) override;
+  bool handle_gateway_response(uint8_t data_type, uint16_t data) override;
+  void handle_print_report(char code, std::string const &value) override;
+
+  // Time put in front of the published lines
+  virtual uint64_t timestamp() const { return unix_ms(); }
+  void publish_value(char source, uint8_t data_type, uint16_t data);
+  virtual void publish(char const *line, size_t length);
+};
+
+int OpenthermGatewayDaemon::serial_available() {
+  if (_read_position == _read_length && !_serial_failed) {
+    ssize_t length = ::read(_serial_fd, _read_buffer.data(), _read_buffer.size());
+    if (length > 0) {
+      _read_position = 0;
+      _read_length = length;
+    } else if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      ESP_LOGE("otgw", "Lost the connection to the gateway");
+      _serial_failed = true;
+    }
+  }
+  return _read_length - _read_position;
+}
+
+int OpenthermGatewayDaemon::serial_read() {
+  if (serial_available() == 0) {
+    return -1;
+  }
+  return static_cast<unsigned char>(_read_buffer[_read_position++]);
+}
+
+void OpenthermGatewayDaemon::serial_write(std::string const &data) {
+  size_t written = 0;
+  while (written != data.size()) {
+    ssize_t length = ::write(_serial_fd, data.data() + written, data.size() - written);
+    if (length < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      ESP_LOGE("otgw", "Failed to write to the gateway: %s", strerror(errno));
+      _serial_failed = true;
+      return;
+    }
+    written += length;
+  }
+}
+
+bool OpenthermGatewayDaemon::handle_slave_response(uint8_t data_type, uint16_t data) {
+  publish_value('B', data_type, data);
+  return true;
+}
+
+bool OpenthermGatewayDaemon::handle_master_request(uint8_t data_type, uint16_t data) {
+  publish_value('T', data_type, data);
+  return true;
+}
+
+bool OpenthermGatewayDaemon::handle_gateway_response(uint8_t data_type, uint16_t data) {
+  publish_value('A', data_type, data);
+  return true;
+}
+
+void OpenthermGatewayDaemon::handle_print_report(char code, std::string const &value) {
+  char line[128];
+  int length = snprintf(line, sizeof(line), "%" PRIu64 " PR %c %s\n", timestamp(), code, value.c_str());
+  length = std::min<int>(length, sizeof(line) - 1);
+  _print_reports[code].assign(line, length);
+  publish(line, length);
+}
+
+void OpenthermGatewayDaemon::publish_value(char source, uint8_t data_type, uint16_t data) {
+  char line[40];
+  int length = snprintf(line, sizeof(line), "%" PRIu64 " %c %u %04X\n", timestamp(), source, data_type, data);
+  publish(line, length);
+}
+
+void OpenthermGatewayDaemon::publish(char const *line, size_t length) {
+  for (size_t i = 0; i != _client_fds.size(); ++i) {
+    auto &output = _client_output[i];
+    if (output.size() + length > MAX_CLIENT_BACKLOG) {
+      // Keep the output of slow clients bounded, they are disconnected on the next flush
+      output.clear();
+      shutdown(_client_fds[i], SHUT_RDWR);
+      continue;
+    }
+    output.append(line, length);
+    flush_client(_client_fds[i]);
+  }
+}
+
+void OpenthermGatewayDaemon::add_client(int fd) {
+  _client_fds.push_back(fd);
+  _client_output.emplace_back();
+  for (auto const &report : _print_reports) {
+    _client_output.back() += report.second;
+  }
+  flush_client(fd);
+}
+
+bool OpenthermGatewayDaemon::flush_client(int fd) {
+  size_t i = std::find(_client_fds.begin(), _client_fds.end(), fd) - _client_fds.begin();
+  auto &output = _client_output[i];
+  while (!output.empty()) {
+    ssize_t length = send(fd, output.data(), output.size(), MSG_NOSIGNAL);
+    if (length < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    output.erase(0, length);
+  }
+  return true;
+}
+
+bool OpenthermGatewayDaemon::client_has_output(int fd) const {
+  size_t i = std::find(_client_fds.begin(), _client_fds.end(), fd) - _client_fds.begin();
+  return !_client_output[i].empty();
+}
+
+void OpenthermGatewayDaemon::remove_client(int fd) {
+  size_t i = std::find(_client_fds.begin(), _client_fds.end(), fd) - _client_fds.begin();
+  close(fd);
+  _client_fds.erase(_client_fds.begin() + i);
+  _client_output.erase(_client_output.begin() + i);
+}
+
+static uint64_t replay_now = 0;
+
+static uint64_t replay_clock() { return replay_now; }
+
+// Plays back a capture through the core. Frames and replies are "received" at the time of the
+// capture, commands sent by the core are answered with the reply the gateway gave to the same command
+// in the capture, or with a plain acknowledgement when it was not captured.
+class OpenthermGatewayReplay : public OpenthermGatewayDaemon {
+ public:
+  OpenthermGatewayReplay() : OpenthermGatewayDaemon(-1) { set_clock(replay_clock); }
+
+  bool load(char const *path);
+  // Runs until the capture is exhausted
+  void run();
+
+ protected:
+  struct Record {
+    uint64_t time;
+    std::string line;
+  };
+  // Frames of the capture, and replies that the core's commands got
+  std::deque<Record> _records;
+  std::deque<Record> _replies;
+  // Replies of the gateway to every captured command, in the order of the capture
+  std::map<std::string, std::deque<std::string>> _captured_replies;
+  std::string _received;
+  uint32_t _answered = 0;
+  uint32_t _synthesized = 0;
+
+  int serial_available() override;
+  int serial_read() override;
+  void serial_write(std::string const &data) override;
+
+  uint64_t timestamp() const override { return now_ms(); }
+  void publish(char const *line, size_t length) override { fwrite(line, 1, length, stdout); }
+};
+
+bool OpenthermGatewayReplay::load(char const *path) {
+  std::ifstream capture(path);
+  if (!capture) {
+    return false;
+  }
+
+  // Log prefixes are allowed, e.g. when the capture is copied from the ESPHome log
+  static std::regex const record(R"((\d+) (?:([TRBA][0-9A-Fa-f]{8})\s*$|([<>]) (.*)$))");
+  std::string line;
+  std::smatch match;
+  std::optional<std::string> command;
+  uint64_t epoch = 0;
+  std::optional<uint32_t> previous;
+  while (std::getline(capture, line)) {
+    if (!std::regex_search(line, match, record)) {
+      continue;
+    }
+
+    // The trace has 32 bit timestamps, which wrap after 49 days
+    uint32_t time = strtoul(match[1].str().c_str(), nullptr, 10);
+    if (previous && time < *previous && *previous - time > UINT32_MAX / 2) {
+      epoch += uint64_t{1} << 32;
+    }
+    previous = time;
+
+    if (match[2].matched) {
+      _records.push_back(Record{epoch + time, match[2].str()});
+    } else if (match[3] == ">") {
+      command = match[4].str();
+    } else if (command) {
+      std::string reply = match[4].str();
+      _captured_replies[*command].push_back(reply.substr(0, reply.find_last_not_of(" \r") + 1));
+      command.reset();
+    }
+  }
+  return true;
+}
+
+void OpenthermGatewayReplay::run() {
+  if (_records.empty()) {
+    return;
+  }
+  uint64_t start = _records.front().time;
+  // Leave time for the last transaction to be finalized
+  uint64_t end = _records.back().time + 1000;
+  replay_now = start;
+
+  while (replay_now < end) {
+    uint64_t next = std::min(next_deadline(), end);
+    if (!_records.empty()) {
+      next = std::min(next, _records.front().time);
+    }
+    if (!_replies.empty()) {
+      next = std::min(next, _replies.front().time);
+    }
+    // Like a loop of the component, time always moves on. Records are received right when they are due.
+    replay_now = std::max(replay_now + 1, next);
+    set_receive_idle(replay_now - 1);
+    process();
+  }
+
+  ESP_LOGI("otgw", "Replayed %.1f s, %" PRIu32 " commands answered from the capture, %" PRIu32 " acknowledged without",
+           (end - start) / 1000.0, _answered, _synthesized);
+}
+
+int OpenthermGatewayReplay::serial_available() {
+  while (!_records.empty() || !_replies.empty()) {
+    // Replies come in between the frames that were captured at the same time
+    bool reply = !_replies.empty() && (_records.empty() || _replies.front().time < _records.front().time);
+    auto &source = reply ? _replies : _records;
+    if (source.front().time > replay_now) {
+      break;
+    }
+    _received += source.front().line;
+    _received += "\r\n";
+    source.pop_front();
+  }
+  return _received.size();
+}
+
+int OpenthermGatewayReplay::serial_read() {
+  if (serial_available() == 0) {
+    return -1;
+  }
+  char c = _received.front();
+  _received.erase(0, 1);
+  return static_cast<unsigned char>(c);
+}
+
+void OpenthermGatewayReplay::serial_write(std::string const &data) {
+  std::string command = data.substr(0, data.find_first_of("\r\n"));
+  std::string reply;
+  auto captured = _captured_replies.find(command);
+  if (captured != _captured_replies.end() && !captured->second.empty()) {
+    reply = captured->second.front();
+    // Later identical commands get the later replies, the last one is repeated
+    if (captured->second.size() > 1) {
+      captured->second.pop_front();
+    }
+    _answered++;
+  } else {
+    // The gateway echoes the value of most commands, reports are unknown
+    std::string value = command.substr(std::min<size_t>(command.size(), 3));
+    reply = command.substr(0, 2) + ": " + (command.compare(0, 3, "PR=") == 0 ? value + "=unknown" : value);
+    _synthesized++;
+  }
+  // The gateway answers within a couple of ms
+  _replies.push_back(Record{replay_now + 5, reply});
+}
+
+}  // namespace otgw
+}  // namespace esphome
+
+using esphome::otgw::OpenthermGatewayDaemon;
+using esphome::otgw::OpenthermGatewayReplay;
+using esphome::otgw::monotonic_ms;
+
+// Upper bound for sleeping, in ms
+static constexpr int MAX_POLL_TIMEOUT = 60'000;
+
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t dump = 0;
+
+static void usage(char const *name) {
+  fprintf(stderr,
+    "Usage: %s [options] DEVICE|--replay CAPTURE\n"
+    "  --socket PATH              unix socket to publish on (default /tmp/otgwd.sock)\n"
+    "  --ids ID[:MINUTES],...     data ids of interest, requested with PM every MINUTES if given.\n"
+    "                             Other data ids are reported as unknown to the gateway.\n"
+    "  --reuse-master-slots       see reuse_master_slots of the component\n"
+    "  --ignore-heater-overrides  see ignore_heater_overrides of the component\n"
+    "  --alternatives             see use_alternatives of the component\n"
+    "  --summary SECONDS          only read the summary report of the gateway, every SECONDS\n"
+    "  --statistics               collect per data id statistics\n"
+    "  --trace SIZE               keep a trace of the last SIZE frames\n"
+    "  --replay CAPTURE           play back a dump of the frame trace instead of reading DEVICE,\n"
+    "                             the values are written to stdout\n"
+    "SIGUSR1 logs the statistics and the trace.\n",
+    name);
+}
+
+static int open_serial(char const *device) {
+  int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // The gateway uses 9600 8N1
+  termios options;
+  if (tcgetattr(fd, &options) == 0) {
+    cfmakeraw(&options);
+    cfsetispeed(&options, B9600);
+    cfsetospeed(&options, B9600);
+    options.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &options);
+  }
+  return fd;
+}
+
+static int open_socket(char const *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    close(fd);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  unlink(path);
+  if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(fd, 8) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool parse_ids(OpenthermGatewayDaemon &gateway, char const *ids) {
+  char const *position = ids;
+  while (*position != '\0') {
+    char *end;
+    unsigned long data_type = strtoul(position, &end, 10);
+    unsigned long interval = 0;
+    if (end == position || data_type > 255) {
+      return false;
+    }
+    if (*end == ':') {
+      position = end + 1;
+      interval = strtoul(position, &end, 10);
+      if (end == position || interval > UINT16_MAX) {
+        return false;
+      }
+    }
+    if (*end != ',' && *end != '\0') {
+      return false;
+    }
+
+    gateway.set_interest(data_type, interval);
+    position = *end == ',' ? end + 1 : end;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  char const *socket_path = "/tmp/otgwd.sock";
+  char const *ids = nullptr;
+  bool reuse_master_slots = false;
+  bool ignore_heater_overrides = false;
+  bool alternatives = false;
+  unsigned long summary_interval = 0;
+  bool statistics = false;
+  unsigned long trace_size = 0;
+  char const *replay = nullptr;
+
+  static option const options[] = {
+    {"socket", required_argument, nullptr, 's'},
+    {"ids", required_argument, nullptr, 'i'},
+    {"reuse-master-slots", no_argument, nullptr, 'r'},
+    {"ignore-heater-overrides", no_argument, nullptr, 'o'},
+    {"alternatives", no_argument, nullptr, 'a'},
+    {"summary", required_argument, nullptr, 'p'},
+    {"statistics", no_argument, nullptr, 'S'},
+    {"trace", required_argument, nullptr, 't'},
+    {"replay", required_argument, nullptr, 'R'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "h", options, nullptr)) != -1) {
+    switch (option) {
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'i':
+        ids = optarg;
+        break;
+      case 'r':
+        reuse_master_slots = true;
+        break;
+      case 'o':
+        ignore_heater_overrides = true;
+        break;
+      case 'a':
+        alternatives = true;
+        break;
+      case 'p':
+        summary_interval = std::min(strtoul(optarg, nullptr, 10), 24 * 3600ul) * 1000;
+        break;
+      case 'S':
+        statistics = true;
+        break;
+      case 't':
+        trace_size = std::min(strtoul(optarg, nullptr, 10), static_cast<unsigned long>(UINT16_MAX));
+        break;
+      case 'R':
+        replay = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - (replay == nullptr ? 1 : 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  auto configure = [&](OpenthermGatewayDaemon &gateway) {
+    if (ids != nullptr && !parse_ids(gateway, ids)) {
+      fprintf(stderr, "Invalid data ids: %s\n", ids);
+      return false;
+    }
+    gateway.reuse_master_slots(reuse_master_slots);
+    gateway.ignore_heater_overrides(ignore_heater_overrides);
+    gateway.use_alternatives(alternatives);
+    gateway.set_summary_interval(summary_interval);
+    gateway.enable_statistics(statistics);
+    gateway.set_trace_size(trace_size);
+    return true;
+  };
+
+  if (replay != nullptr) {
+    OpenthermGatewayReplay gateway;
+    if (!gateway.load(replay)) {
+      fprintf(stderr, "Failed to read %s: %s\n", replay, strerror(errno));
+      return 1;
+    }
+    if (!configure(gateway)) {
+      return 1;
+    }
+    gateway.begin();
+    gateway.run();
+    if (statistics) {
+      gateway.dump_statistics();
+    }
+    if (trace_size != 0) {
+      gateway.dump_trace();
+    }
+    return 0;
+  }
+
+  int serial_fd = open_serial(argv[optind]);
+  if (serial_fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  int listen_fd = open_socket(socket_path);
+  if (listen_fd < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+    return 1;
+  }
+
+  OpenthermGatewayDaemon gateway(serial_fd);
+  if (!configure(gateway)) {
+    return 1;
+  }
+
+  struct sigaction action{};
+  action.sa_handler = [](int) { stop = 1; };
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  action.sa_handler = [](int) { dump = 1; };
+  sigaction(SIGUSR1, &action, nullptr);
+
+  gateway.begin();
+
+  std::vector<pollfd> fds;
+  while (!stop && !gateway.serial_failed()) {
+    gateway.process();
+
+    if (dump) {
+      dump = 0;
+      gateway.dump_statistics();
+      gateway.dump_trace();
+    }
+
+    fds.clear();
+    fds.push_back(pollfd{serial_fd, POLLIN, 0});
+    fds.push_back(pollfd{listen_fd, POLLIN, 0});
+    for (int fd : gateway.clients()) {
+      fds.push_back(pollfd{fd, static_cast<short>(POLLIN | (gateway.client_has_output(fd) ? POLLOUT : 0)), 0});
+    }
+
+    // Sleep until something arrives, or until the core has a timeout or request due
+    int timeout = -1;
+    uint64_t deadline = gateway.next_deadline();
+    if (gateway.has_buffered_input()) {
+      timeout = 0;
+    } else if (deadline != UINT64_MAX) {
+      uint64_t now = monotonic_ms();
+      timeout = deadline <= now ? 0 : std::min<uint64_t>(deadline - now, MAX_POLL_TIMEOUT);
+    }
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      // What the kernel has buffered only just arrived, which makes the timestamps of the lines precise
+      gateway.set_receive_idle(monotonic_ms());
+    }
+
+    if (fds[1].revents & POLLIN) {
+      int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd >= 0) {
+        gateway.add_client(client_fd);
+      }
+    }
+
+    for (size_t i = 2; i != fds.size(); ++i) {
+      bool gone = fds[i].revents & (POLLERR | POLLHUP | POLLNVAL);
+      if (!gone && (fds[i].revents & POLLIN)) {
+        // Clients only listen, anything they send is discarded
+        char discard[64];
+        gone = recv(fds[i].fd, discard, sizeof(discard), 0) == 0;
+      }
+      if (!gone && (fds[i].revents & POLLOUT)) {
+        gone = !gateway.flush_client(fds[i].fd);
+      }
+      if (gone) {
+        gateway.remove_client(fds[i].fd);
+      }
+    }
+  }
+
+  close(listen_fd);
+  unlink(socket_path);
+  return gateway.serial_failed() ? 1 : 0;
+}